@@ -1,15 +1,38 @@
-CFLAGS :=
-LFLAGS :=
+# Load PNG & JPEG natively rather than CImg spawning ImageMagick / GraphicsMagick for every image
+# The bundled lpng1624 & jpeg-6b are prebuilt Windows libraries so link the system libpng, libjpeg & zlib here
+# Both objects need the same CImg defines so anything linking libimage2mode7.a needs IMAGE_LIBS too
+IMAGE_DEFINES := -Dcimg_use_png -Dcimg_use_jpeg
+IMAGE_LIBS := -lpng -ljpeg -lz
+
+# Optimised like the Visual Studio Release build - the solver is far too slow without
+OPTIMISE := -O2
+
+# No windows to open so CImg doesn't need X11
+CFLAGS := $(OPTIMISE) -pthread -Dcimg_display=0 $(IMAGE_DEFINES)
+LFLAGS := -pthread
 
 CC := g++
+C_CC := gcc
 LINK := g++
+AR := ar
 
 BUILD_DIR     := build
 
-all: $(BUILD_DIR)/image2mode7
+# libb64 for the edit.tf URL
+B64_OBJS := $(BUILD_DIR)/cencode.o $(BUILD_DIR)/cdecode.o
+
+all: $(BUILD_DIR)/image2mode7 $(BUILD_DIR)/libimage2mode7.a
 
 $(BUILD_DIR)/%.o: image2mode7/%.cpp
+	@mkdir -p $(BUILD_DIR)
 	$(CC) $(CFLAGS) $(INCLUDE) $< -c -o $@
 
-$(BUILD_DIR)/image2mode7: $(BUILD_DIR)/image2mode7.o
-	$(LINK) $(LFLAGS) $< -o $@
+$(BUILD_DIR)/%.o: image2mode7/%.c
+	@mkdir -p $(BUILD_DIR)
+	$(C_CC) $(OPTIMISE) $(INCLUDE) $< -c -o $@
+
+$(BUILD_DIR)/libimage2mode7.a: $(BUILD_DIR)/libimage2mode7.o $(B64_OBJS)
+	$(AR) rcs $@ $^
+
+$(BUILD_DIR)/image2mode7: $(BUILD_DIR)/image2mode7.o $(BUILD_DIR)/libimage2mode7.o $(B64_OBJS)
+	$(LINK) $(LFLAGS) $^ $(IMAGE_LIBS) -o $@
@@ -1,13 +1,30 @@
 // image2mode7.cpp : Defines the entry point for the console application.
 //
-// Generic image -> mode 7 (aka Teletext) conversion routine
-// Based on an initial algorithm by Puppeh (Julian Brown)
+// Command line front end for the MODE 7 (aka Teletext) conversion library in libimage2mode7.cpp
 //
 
 #include "targetver.h"
 
 #include <stdio.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
 #include <tchar.h>
+#include <process.h>				// windows.h for FindFirstFile comes in with CImg.h
+#define getpid _getpid
+#else
+#include <glob.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "CImg.h"
 
@@ -17,688 +34,956 @@ extern "C"
 #include "b64/cdecode.h"
 }
 
+#include "libimage2mode7.h"
+
 using namespace cimg_library;
 
 #define MODE7_WIDTH			40
 #define MODE7_HEIGHT		25
 #define MODE7_MAX_SIZE		(MODE7_WIDTH * MODE7_HEIGHT)
 
-#define IMAGE_W				(src._width)
-#define IMAGE_H				(src._height)
-
-#define MODE7_PIXEL_W		78
-#define MODE7_PIXEL_H		75
+#define MODE7_BLANK			32
 
-#define FRAME_WIDTH			(frame_width)
 #define FRAME_HEIGHT		(frame_height)
 #define FRAME_SIZE			(MODE7_WIDTH * FRAME_HEIGHT)
-#define FRAME_FIRST_COLUMN	1				// (MODE7_WIDTH - FRAME_WIDTH)
 
-#define MODE7_BLANK			32
-#define MODE7_BLACK_BG		156
-#define MODE7_NEW_BG		157
-#define MODE7_HOLD_GFX		158
-#define MODE7_RELEASE_GFX	159
-#define MODE7_GFX_COLOUR	144
-#define MODE7_CONTIG_GFX	153
-#define MODE7_SEP_GFX		154
+static unsigned char mode7[IMAGE2MODE7_MAX_PAGE_SIZE];
 
-#define CLAMP(a,low,high)	((a) < (low) ? (low) : ((a) > (high) ? (high) : (a)))
-#define THRESHOLD(a,t)		((a) >= (t) ? 255 : 0)
+static int frame_width;
+static int frame_height;
 
-#define MAX_STATE			(1U << 15)
-#define GET_STATE(fg,bg,hold_mode,last_gfx_char,sep)	( (sep) << 14 | (last_gfx_char) << 7 | (hold_mode) << 6 | ((bg) << 3) | (fg))
+//
+// Conversion cache - pages stored in a directory by a hash of the image file & every option that changes the output
+//
 
-#define IMAGE_X_FROM_X7(x7)	(((x7) - FRAME_FIRST_COLUMN) * 2)
-#define IMAGE_Y_FROM_Y7(x7)	((y7) * 3)
+// 128-bit key as two 64-bit FNV-1a style hashes with different primes so a collision in one is very unlikely to be in both
+struct cache_key
+{
+	unsigned long long a;
+	unsigned long long b;
+};
 
-#define MIN(A,B)			((A)<(B)?(A):(B))
-#define MAX(A,B)			((A)>(B)?(A):(B))
-#define MAX_3(A,B,C)		((A)>(B)?((A)>(C)?(A):(C)):(B)>(C)?(B):(C))
-#define MIN_3(A,B,C)		((A)<(B)?((A)<(C)?(A):(C)):(B)<(C)?(B):(C))
+static void hash_cache_bytes(cache_key *key, const unsigned char *bytes, int size)
+{
+	for (int i = 0; i < size; i++)
+	{
+		key->a = (key->a ^ bytes[i]) * 0x100000001b3ULL;
+		key->b = (key->b ^ bytes[i]) * 0xff51afd7ed558ccdULL;
+		key->b ^= key->b >> 29;
+	}
+}
 
-#define _COLOUR_DEBUG		FALSE
+// Start of the key - the image is added with hash_cache_bytes
+static cache_key get_cache_key(const image2mode7_options *options)
+{
+	cache_key key = { 0xcbf29ce484222325ULL, 0x9e3779b97f4a7c15ULL };
+
+	// Anything that can change the page - not the diagnostics, kernels, threads or row cache
+	// The dense memo gives the same page as the sparse one unless its errors are scaled
+	int settings[] = {
+		2,			// bump if the converter changes its output
+		options->no_scale, options->dither, options->use_quant,
+		options->sat, options->value, options->black, options->white,
+		options->use_hold, options->use_fill, options->use_sep, options->sep_fg_factor,
+		options->use_geometric, options->try_all,
+		options->use_dense_memo && options->memo_scale > 1 ? options->memo_scale : 1, options->use_best_first, options->beam_width
+	};
+
+	hash_cache_bytes(&key, (const unsigned char *)settings, sizeof(settings));
+
+	return key;
+}
 
-static CImg<unsigned char> src;
-static unsigned char mode7[MODE7_MAX_SIZE * 8];
+// Key for an image file from its bytes so a cached page can be used without decoding it
+// Returns false if it can't be read as a file (e.g. a URL for CImg to fetch)
+static bool get_file_cache_key(const char *input_name, const image2mode7_options *options, cache_key *key)
+{
+	FILE *file = fopen(input_name, "rb");
 
-static int total_error_in_state[MAX_STATE][MODE7_WIDTH + 1];
-static unsigned char char_for_xpos_in_state[MAX_STATE][MODE7_WIDTH + 1];
-static unsigned char output[MODE7_WIDTH];
+	if (!file)
+		return false;
 
-static bool global_use_hold = true;
-static bool global_use_fill = true;
-static bool global_use_sep = true;
-static bool global_use_geometric = true;
-static bool global_try_all = false;
+	*key = get_cache_key(options);
 
-static int global_sep_fg_factor = 128;
-static int global_dither = 0;
+	unsigned char buffer[65536];
+	size_t size;
 
-static int frame_width;
-static int frame_height;
+	while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		hash_cache_bytes(key, buffer, (int)size);
+	}
 
-static int dither2[4] = {
-	2, 6,
-	8, 4
-};
+	bool ok = !ferror(file);
+	fclose(file);
 
-static int dither23[6] = {
-	2, 8,
-	12, 4,
-	6, 10
-};
+	return ok;
+}
 
-static int dither3[9] = {
-	2, 16, 8,
-	14, 12, 6,
-	10, 4, 18
-};
+// Key for an image that could only be loaded whole - from its pixels
+static cache_key get_pixel_cache_key(const unsigned char *rgb, int width, int height, const image2mode7_options *options)
+{
+	cache_key key = get_cache_key(options);
 
-static int dither4[16] = {
-	2, 18, 6, 22,
-	26, 10, 30, 14,
-	8, 24, 4, 20,
-	32, 16, 28, 12
-};
+	int size[] = { width, height };
 
+	hash_cache_bytes(&key, (const unsigned char *)size, sizeof(size));
+	hash_cache_bytes(&key, rgb, width * height * 3);
 
-void clear_error_char_arrays(void)
+	return key;
+}
+
+#define CACHE_FILENAME_SIZE		1024
+#define CACHE_TEMP_SUFFIX_SIZE	32
+
+// Returns false if the name doesn't fit - a clipped name could be some other file so don't use the cache at all
+static bool get_cache_filename(char *filename, int size, const char *cache_dir, cache_key key)
+{
+	int length = snprintf(filename, size, "%s/%016llx%016llx.bin", cache_dir, key.a, key.b);
+
+	return length >= 0 && length < size;
+}
+
+// Returns the page size or 0 if it's not in the cache
+static int load_cached_page(const char *cache_filename, unsigned char *page)
+{
+	FILE *file = fopen(cache_filename, "rb");
+
+	if (!file)
+		return 0;
+
+	unsigned char buffer[IMAGE2MODE7_MAX_PAGE_SIZE + 1];
+
+	int size = (int)fread(buffer, 1, sizeof(buffer), file);
+	fclose(file);
+
+	// Anything that isn't whole character rows can't be one of ours
+	if (size <= 0 || size > IMAGE2MODE7_MAX_PAGE_SIZE || size % MODE7_WIDTH)
+		return 0;
+
+	memcpy(page, buffer, size);
+
+	return size;
+}
+
+static void save_cached_page(const char *cache_filename, const unsigned char *page, int size)
 {
-	for (int state = 0; state < MAX_STATE; state++)
+	// Write to a temporary file next to the entry then rename it into place so other runs never see half a page
+	char temp_filename[CACHE_FILENAME_SIZE + CACHE_TEMP_SUFFIX_SIZE];
+	int length = snprintf(temp_filename, sizeof(temp_filename), "%s.%d.tmp", cache_filename, (int)getpid());
+
+	// Never write to a clipped name - rename would move the wrong file into place
+	if (length < 0 || length >= (int)sizeof(temp_filename))
+		return;
+
+	FILE *file = fopen(temp_filename, "wb");
+
+	if (!file)
+		return;
+
+	bool ok = fwrite(page, 1, size, file) == (size_t)size;
+
+	if (fclose(file) != 0)
+		ok = false;
+
+	// Windows won't rename over an existing file but that can only be the same page from another run
+	if (!ok || rename(temp_filename, cache_filename) != 0)
 	{
-		for (int x = 0; x <= MODE7_WIDTH; x++)
-		{
-			total_error_in_state[state][x] = -1;
-			char_for_xpos_in_state[state][x] = 'X';
-		}
+		remove(temp_filename);
 	}
 }
 
-int get_state_for_char(unsigned char proposed_char, int old_state)
+// Look for the page with this key in the cache - size is 0 if it isn't there
+// Returns false if the cache can't be used for it at all
+static bool open_page_cache(const char *cache_dir, cache_key key, const image2mode7_options *options, char *cache_filename, unsigned char *page, int *size)
 {
-	int fg = old_state & 7;
-	int bg = (old_state >> 3) & 7;
-	int hold_mode = (old_state >> 6) & 1;
-	unsigned char last_gfx_char = (old_state >> 7) & 0x7f;
-	int sep = (old_state >> 14) & 1;
+	bool use_cache = get_cache_filename(cache_filename, CACHE_FILENAME_SIZE, cache_dir, key);
 
-	if (global_use_fill)
-	{
-		if (proposed_char == MODE7_NEW_BG)
-		{
-			bg = fg;
-		}
+	*size = use_cache ? load_cached_page(cache_filename, page) : 0;
 
-		if (proposed_char == MODE7_BLACK_BG)
-		{
-			bg = 0;
-		}
+	if (options->verbose)
+	{
+		if (use_cache)
+			printf("%s '%s'...\n", *size ? "Using cached MODE 7 frame" : "No cached MODE 7 frame", cache_filename);
+		else
+			printf("Cache directory name too long - not caching MODE 7 frame\n");
 	}
 
-	if (proposed_char > MODE7_GFX_COLOUR && proposed_char < MODE7_GFX_COLOUR + 8)
+	return use_cache;
+}
+
+//
+// Image loading - PNG & JPEG are streamed a row at a time into the library so memory doesn't depend on the image size
+//
+
+// Decoded rows go to the library's streaming conversion
+struct image_stream
+{
+	image2mode7_context *context;
+	const image2mode7_options *options;
+};
+
+static void begin_image_stream(image_stream *stream, int width, int height)
+{
+	image2mode7_begin(stream->context, width, height);
+}
+
+static void add_image_stream_row(image_stream *stream, const unsigned char *rgb)
+{
+	image2mode7_add_rows(stream->context, rgb, 1);
+}
+
+#ifdef cimg_use_jpeg
+struct jpeg_error_handler
+{
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((jpeg_error_handler *)cinfo->err)->jump, 1);
+}
+
+// Decode a JPEG a row at a time using libjpeg's DCT scaling to skip most of the work for big photos
+// Picks the smallest 1/2, 1/4 or 1/8 scale that still has at least as many pixels as the page needs
+// Returns false for anything it can't handle (CMYK, errors) so the caller can fall back to CImg
+static bool stream_jpeg(image_stream *stream, const char *filename)
+{
+	FILE *file = fopen(filename, "rb");
+
+	if (!file)
+		return false;
+
+	struct jpeg_decompress_struct cinfo;
+	jpeg_error_handler error;
+	unsigned char *volatile row = NULL;
+	unsigned char *volatile rgb = NULL;
+
+	cinfo.err = jpeg_std_error(&error.mgr);
+	error.mgr.error_exit = jpeg_error_exit;
+
+	if (setjmp(error.jump))
 	{
-		fg = proposed_char - MODE7_GFX_COLOUR;
+		jpeg_destroy_decompress(&cinfo);
+		fclose(file);
+		free(row);
+		free(rgb);
+		return false;
 	}
 
-	if (global_use_hold)
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, file);
+	jpeg_read_header(&cinfo, TRUE);
+
+	int full_width = cinfo.image_width;
+	int full_height = cinfo.image_height;
+
+	for (int denom = 8; denom > 1 && !stream->options->no_scale; denom /= 2)
 	{
-		if (proposed_char == MODE7_HOLD_GFX)
-		{
-			hold_mode = true;
-		}
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = denom;
+		jpeg_calc_output_dimensions(&cinfo);
 
-		if (proposed_char == MODE7_RELEASE_GFX)
-		{
-			hold_mode = false;
-			last_gfx_char = MODE7_BLANK;
-		}
+		if ((int)cinfo.output_width >= IMAGE2MODE7_PIXEL_WIDTH && (int)cinfo.output_height >= IMAGE2MODE7_PIXEL_HEIGHT)
+			break;
 
-		if (proposed_char < 128)
-		{
-			last_gfx_char = proposed_char;
-		}
+		cinfo.scale_denom = 1;
 	}
-	else
+
+	jpeg_start_decompress(&cinfo);
+
+	int components = cinfo.output_components;
+
+	if (components != 1 && components != 3)
+	{
+		jpeg_destroy_decompress(&cinfo);
+		fclose(file);
+		return false;
+	}
+
+	if (stream->options->verbose)
 	{
-		hold_mode = false;
-		last_gfx_char = MODE7_BLANK;
+		printf("Decoding JPEG at 1/%d scale from %d x %d to %d x %d pixels...\n", (int)cinfo.scale_denom, full_width, full_height, (int)cinfo.output_width, (int)cinfo.output_height);
 	}
 
-	if (global_use_sep)
+	int width = cinfo.output_width;
+	int height = cinfo.output_height;
+
+	row = (unsigned char *)malloc(width * components);
+	rgb = (unsigned char *)malloc(width * 3);
+
+	begin_image_stream(stream, width, height);
+
+	while ((int)cinfo.output_scanline < height)
 	{
-		if (proposed_char == MODE7_SEP_GFX)
+		JSAMPROW rows[1] = { row };
+
+		if (jpeg_read_scanlines(&cinfo, rows, 1) != 1)
 		{
-			sep = true;
+			// Suspended data source - rest of the image stays black
+			break;
 		}
 
-		if (proposed_char == MODE7_CONTIG_GFX)
+		// Grey images just repeat the one channel
+		for (int x = 0; x < width; x++)
 		{
-			sep = false;
+			const unsigned char *sample = &row[x * components];
+
+			rgb[x * 3 + 0] = sample[0];
+			rgb[x * 3 + 1] = sample[components > 1 ? 1 : 0];
+			rgb[x * 3 + 2] = sample[components > 2 ? 2 : 0];
 		}
+
+		add_image_stream_row(stream, rgb);
 	}
 
-	return GET_STATE(fg, bg, hold_mode, last_gfx_char, sep);
-}
+	jpeg_destroy_decompress(&cinfo);
+	fclose(file);
 
+	free(row);
+	free(rgb);
 
-int get_colour_from_rgb(unsigned char r, unsigned char g, unsigned char b)
-{
-	return (r ? 1 : 0) + (g ? 2 : 0) + (b ? 4 : 0);
+	return true;
 }
+#endif
 
-#define GET_RED_FROM_COLOUR(c)		(c & 1 ? 255:0)
-#define GET_GREEN_FROM_COLOUR(c)	(c & 2 ? 255:0)
-#define GET_BLUE_FROM_COLOUR(c)		(c & 4 ? 255:0)
-
-unsigned char pixel_to_grey(int mode, unsigned char r, unsigned char g, unsigned char b)
+#ifdef cimg_use_png
+// Decode a non-interlaced PNG a row at a time, converted to 8-bit RGB by libpng (alpha is ignored like the CImg path)
+// Returns false for anything it can't handle (interlaced, errors) so the caller can fall back to CImg
+static bool stream_png(image_stream *stream, const char *filename)
 {
-	switch (mode)
-	{
-	case 1:
-		return r;
+	FILE *file = fopen(filename, "rb");
 
-	case 2:
-		return g;
+	if (!file)
+		return false;
 
-	case 3:
-		return b;
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png ? png_create_info_struct(png) : NULL;
+	unsigned char *volatile rgb = NULL;
 
-	case 4:
-		return (unsigned char)((r + g + b) / 3);
+	if (!info || setjmp(png_jmpbuf(png)))
+	{
+		png_destroy_read_struct(&png, info ? &info : NULL, NULL);
+		fclose(file);
+		free(rgb);
+		return false;
+	}
 
-	case 5:
-		return (unsigned char)(0.2126f * r + 0.7152f * g + 0.0722f * b);
+	png_init_io(png, file);
+	png_read_info(png, info);
 
-	default:
-		return 0;
+	if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE)
+	{
+		// Passes cover the whole image so there's nothing to gain over CImg
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(file);
+		return false;
 	}
-}
 
-// For each character cell on this line
-// Do we have pixels or not?
-// If we have pixels then need to decide whether is it better to replace this cell with a control code or use a graphic character
-// If we don't have pixels then need to decide whether it is better to insert a control code or leave empty
-// Possible control codes are: new fg colour, fill (bg colour = fg colour), no fill (bg colour = black), hold graphics (hold char = prev char), release graphics (hold char = empty)
-// "Better" means that the "error" for the rest of the line (appearance on screen vs actual image = deviation) is minimised
-
-// Hold graphics mode means use last known (used on the line) graphic character in place of space when emitting a control code (reset if using alphanumerics not graphics)
-// Palette order = black - red - green - yellow - blue - magenta - cyan - white
-// Brightness order = black - blue - red - magenta - green - cyan - yellow - white
-// Hue order = red - yellow - green - cyan - blue - magenta - red
-
-// Luma values
-// B = 0 ~= 0
-// B = 18 = 18 ~= 1x
-// R = 54 = 18 + 36 ~= 3x
-// M = 73 = 18 + 36 + 19 ~= 4x
-// G = 182 = 18 + 36 + 19 + 109 ~= 10x
-// C = 201 = 18 + 36 + 19 + 109 + 19 ~= 11x
-// Y = 237 = 18 + 36 + 19 + 109 + 19 + 36 ~= 13x
-// W = 255 = 18 + 36 + 19 + 109 + 19 + 36 + 18 ~= 14x
-
-static int error_colour_vs_colour[8][8] = {
-
-#if 0		// This maps error to luma when comparing colours against black/white
-	{ 0, 3, 10, 13, 1, 4, 11, 14 },		// black
-	{ 3, 0, 8, 4, 8, 4, 12, 11 },		// red
-	{ 10, 8, 0, 4, 8, 12, 4, 4 },		// green
-	{ 13, 4, 4, 0, 12, 8, 8, 1 },		// yellow
-	{ 1, 8, 8, 12, 0, 4, 4, 13 },		// blue
-	{ 4, 4, 12, 8, 4, 0, 8, 10 },		// magenta
-	{ 11, 12, 4, 8, 4, 8, 0, 3 },		// cyan
-	{ 14, 11, 4, 1, 13, 10, 3, 0 },		// white
-#else		// This maps colours in brightness order when comparing against black/white
-	{ 0, 2, 4, 6, 1, 3, 5, 7 },		// black
-	{ 2, 0, 4, 2, 4, 2, 6, 5 },		// red
-	{ 4, 4, 0, 2, 4, 6, 2, 3 },		// green
-	{ 6, 2, 2, 0, 6, 4, 4, 1 },		// yellow
-	{ 1, 4, 4, 6, 0, 2, 2, 6 },		// blue
-	{ 3, 2, 6, 4, 2, 0, 4, 4 },		// magenta
-	{ 5, 6, 2, 4, 2, 4, 0, 2 },		// cyan
-	{ 7, 5, 3, 1, 6, 4, 2, 0 },		// white
-#endif
-};
+	png_set_strip_16(png);
+	png_set_packing(png);
+	png_set_expand(png);
+	png_set_strip_alpha(png);
+	png_set_gray_to_rgb(png);
+	png_read_update_info(png, info);
 
-int error_function(int screen_r, int screen_g, int screen_b, int image_r, int image_g, int image_b)
-{
-	if (global_use_geometric)
+	int width = png_get_image_width(png, info);
+	int height = png_get_image_height(png, info);
+
+	if (stream->options->verbose)
 	{
-		return (((screen_r - image_r) * (screen_r - image_r)) + ((screen_g - image_g) * (screen_g - image_g)) + ((screen_b - image_b) * (screen_b - image_b))); // / (255 * 255);
+		printf("Decoding PNG a row at a time from %d x %d pixels...\n", width, height);
 	}
-	else
+
+	rgb = (unsigned char *)malloc(png_get_rowbytes(png, info));
+
+	begin_image_stream(stream, width, height);
+
+	for (int y = 0; y < height; y++)
 	{
-		// Use lookup
-		return error_colour_vs_colour[get_colour_from_rgb(screen_r, screen_g, screen_b)][get_colour_from_rgb(image_r, image_g, image_b)];
+		png_read_row(png, rgb, NULL);
+
+		add_image_stream_row(stream, rgb);
 	}
+
+	png_destroy_read_struct(&png, &info, NULL);
+	fclose(file);
+
+	free(rgb);
+
+	return true;
 }
+#endif
 
-int get_error_for_screen_pixel(int x, int y, int screen_bit, int fg, int bg, bool sep)
+// Stream the image into the library if we can decode it a row at a time ourselves
+static bool stream_image_file(image_stream *stream, const char *input_name)
 {
-	int screen_r, screen_g, screen_b;
-	int image_r, image_g, image_b;
+	const char *extension = strrchr(input_name, '.');
 
-	// These are the pixels in the image
+	if (!extension)
+		return false;
 
-	image_r = src(x, y, 0);
-	image_g = src(x, y, 1);
-	image_b = src(x, y, 2);
+#ifdef cimg_use_jpeg
+	if (!cimg::strcasecmp(extension, ".jpg") || !cimg::strcasecmp(extension, ".jpeg") || !cimg::strcasecmp(extension, ".jpe"))
+		return stream_jpeg(stream, input_name);
+#endif
 
-	// These are the pixels that will get written to the screen
+#ifdef cimg_use_png
+	if (!cimg::strcasecmp(extension, ".png"))
+		return stream_png(stream, input_name);
+#endif
 
-	if (screen_bit)
-	{
-		if (sep)
-		{ 
-			screen_r = (global_sep_fg_factor * GET_RED_FROM_COLOUR(fg) + (255 - global_sep_fg_factor) * GET_RED_FROM_COLOUR(bg)) / 255;
-			screen_g = (global_sep_fg_factor * GET_GREEN_FROM_COLOUR(fg) + (255 - global_sep_fg_factor) * GET_GREEN_FROM_COLOUR(bg)) / 255;
-			screen_b = (global_sep_fg_factor * GET_BLUE_FROM_COLOUR(fg) + (255 - global_sep_fg_factor) * GET_BLUE_FROM_COLOUR(bg)) / 255;
-		}
-		else
-		{
-			screen_r = GET_RED_FROM_COLOUR(fg);
-			screen_g = GET_GREEN_FROM_COLOUR(fg);
-			screen_b = GET_BLUE_FROM_COLOUR(fg);
-		}
-	}
-	else
+	return false;
+}
+
+// Load any image as 8-bit interleaved RGB for the library - throws CImgException if it can't be loaded
+static unsigned char *load_image_rgb(const char *input_name, int *width, int *height)
+{
+	CImg<unsigned char> image(input_name);
+
+	// Library takes interleaved 8-bit RGB - grey images just repeat the one channel
+
+	*width = image._width;
+	*height = image._height;
+	unsigned char *rgb = (unsigned char *)malloc(*width * *height * 3);
+
+	cimg_forXY(image, x, y)
 	{
-		screen_r = GET_RED_FROM_COLOUR(bg);
-		screen_g = GET_GREEN_FROM_COLOUR(bg);
-		screen_b = GET_BLUE_FROM_COLOUR(bg);
-	}
+		unsigned char *pixel = &rgb[(y * *width + x) * 3];
 
-	// Calculate the error between them
+		pixel[0] = image(x, y, 0);
+		pixel[1] = image(x, y, image._spectrum > 1 ? 1 : 0);
+		pixel[2] = image(x, y, image._spectrum > 2 ? 2 : 0);
+	}
 
-	return error_function(screen_r, screen_g, screen_b, image_r, image_g, image_b);
+	return rgb;
 }
 
-int get_error_for_screen_char(int x7, int y7, unsigned char screen_char, int fg, int bg, bool sep)
+// Load an image & convert it into page (blank outside the frame) using the cache if there is one
+// Returns the number of bytes of the page that were written - throws CImgException if the image can't be loaded
+static int convert_image_file(image2mode7_context *context, const image2mode7_options *options, const char *input_name, const char *cache_dir, unsigned char *page, int *frame_error, bool *cached)
 {
-	int x = IMAGE_X_FROM_X7(x7);
-	int y = IMAGE_Y_FROM_Y7(y7);
+	if (options->verbose)
+	{
+		printf("Loading image file '%s'...\n", input_name);
+	}
 
-	int error = 0;
+	// Anything the library doesn't write stays blank (the URL always covers a full page)
+	memset(page, MODE7_BLANK, IMAGE2MODE7_MAX_PAGE_SIZE);
 
-	error += get_error_for_screen_pixel(x, y, screen_char & 1, fg, bg, sep);
+	char cache_filename[CACHE_FILENAME_SIZE];
+	bool use_cache = false;
+	int size = 0;
 
-	error += get_error_for_screen_pixel(x + 1, y, screen_char & 2, fg, bg, sep);
+	*frame_error = 0;
+	*cached = false;
 
-	error += get_error_for_screen_pixel(x, y + 1, screen_char & 4, fg, bg, sep);
+	// Files are keyed on their bytes so a cached page doesn't need the image decoding at all
 
-	error += get_error_for_screen_pixel(x + 1, y + 1, screen_char & 8, fg, bg, sep);
+	cache_key key;
+	bool have_key = cache_dir && get_file_cache_key(input_name, options, &key);
 
-	error += get_error_for_screen_pixel(x, y + 2, screen_char & 16, fg, bg, sep);
+	if (have_key)
+	{
+		use_cache = open_page_cache(cache_dir, key, options, cache_filename, page, &size);
+		*cached = size > 0;
 
-	error += get_error_for_screen_pixel(x + 1, y + 2, screen_char & 64, fg, bg, sep);
+		if (size)
+			return size;
+	}
 
-	// For all six pixels in the character cell
+	image_stream stream;
+	stream.context = context;
+	stream.options = options;
 
-	return error;
-}
+	bool streamed = stream_image_file(&stream, input_name);
 
-// Functions - get_error_for_char(int x7, int y7, unsigned char code, int fg, int bg, unsigned char hold_char)
-int get_error_for_char(int x7, int y7, unsigned char proposed_char, int fg, int bg, bool hold_mode, unsigned char last_gfx_char, bool sep)
-{
-	// If proposed character >= 128 then this is a control code
-	// If so then the hold char will be displayed on screen
-	// Otherwise it will be our proposed character (pixels)
+	// Everything else is loaded whole by CImg
 
-	unsigned char screen_char;
+	int width = 0, height = 0;
+	unsigned char *rgb = streamed ? NULL : load_image_rgb(input_name, &width, &height);
 
-	if (hold_mode)
+	if (cache_dir && !have_key && rgb)
 	{
-		screen_char = (proposed_char >= 128) ? last_gfx_char : proposed_char;
+		use_cache = open_page_cache(cache_dir, get_pixel_cache_key(rgb, width, height, options), options, cache_filename, page, &size);
+		*cached = size > 0;
 	}
-	else
+
+	if (!size)
 	{
-		screen_char = (proposed_char >= 128) ? MODE7_BLANK : proposed_char;
+		if (streamed)
+		{
+			size = image2mode7_finish(context, page, frame_error);
+		}
+		else
+		{
+			size = image2mode7_convert(context, rgb, width, height, page, frame_error);
+		}
+
+		if (use_cache && size > 0)
+		{
+			save_cached_page(cache_filename, page, size);
+		}
+	}
+
+	free(rgb);
+	rgb = NULL;
+
+	return size;
+}
+
+static bool write_file(const char *filename, const unsigned char *page, int size)
+{
+	FILE *file = fopen(filename, "wb");
+
+	if (!file)
+		return false;
+
+	fwrite(page, 1, size, file);
+	fclose(file);
+
+	return true;
+}
+
+// BBC name is the first 7 characters of name up to any dot
+static bool write_inf_file(const char *filename, const char *name)
+{
+	FILE *file = fopen(filename, "wb");
+
+	if (!file)
+		return false;
+
+	char buffer[256];
+	char beeb_name[8];
+	strncpy(beeb_name, name, 7);
+	beeb_name[7] = '\0';
+	char* dot = strchr(beeb_name, '.');
+	if (dot != NULL) {
+		*dot = '\0';
 	}
+	sprintf(buffer, "$.%s      FF7C00 FF7C00\n", beeb_name);
 
-	return get_error_for_screen_char(x7, y7, screen_char, fg, bg, sep);
+	fwrite(buffer, 1, strlen(buffer), file);
+	fclose(file);
+
+	return true;
 }
 
-unsigned char get_graphic_char_from_image(int x7, int y7, int fg, int bg, bool sep)
+#define EDITTF_URL_SIZE		(32 + (MODE7_MAX_SIZE * 7) / 6)
+
+// edit.tf URL for the first page of MODE 7 characters
+static void get_edittf_url(const unsigned char *page, char *url)
 {
-	int min_error = INT_MAX;
-	int on_error, off_error;
-	unsigned char min_char = 32;
-	unsigned char direct_char = 0;
+	/* set up a destination buffer large enough to hold the encoded data */
+	unsigned char *mode77 = (unsigned char *)malloc((MODE7_MAX_SIZE * 7) / 8);
+	unsigned char *bits7 = mode77;
 
-	int x = IMAGE_X_FROM_X7(x7);
-	int y = IMAGE_Y_FROM_Y7(y7);
+	for (int i = 0; i < MODE7_MAX_SIZE; i+=8)
+	{
+		// 8 enter, 7 leave
+		unsigned char c;
+
+		c = page[i];					// 1
+		*bits7 = (c & 0x7f) << 1;
 
-	// Try every possible combination of pixels to get lowest error
+		c = page[i + 1];				// 2
+		*bits7++ |= (c & 0x40) >> 6;
+		*bits7 = (c & 0x3f) << 2;
 
-	on_error = get_error_for_screen_pixel(x, y, 1, fg, bg, sep);
-	off_error = get_error_for_screen_pixel(x, y, 0, fg, bg, sep);
-	min_char += (on_error < off_error ? 1 : 0);
+		c = page[i + 2];				// 3
+		*bits7++ |= (c & 0x60) >> 5;
+		*bits7 = (c & 0x1f) << 3;
 
-	on_error = get_error_for_screen_pixel(x + 1, y, 1, fg, bg, sep);
-	off_error = get_error_for_screen_pixel(x + 1, y, 0, fg, bg, sep);
-	min_char += (on_error < off_error ? 2 : 0);
+		c = page[i + 3];				// 4
+		*bits7++ |= (c & 0x70) >> 4;
+		*bits7 = (c & 0x0f) << 4;
 
-	on_error = get_error_for_screen_pixel(x, y + 1, 1, fg, bg, sep);
-	off_error = get_error_for_screen_pixel(x, y + 1, 0, fg, bg, sep);
-	min_char += (on_error < off_error ? 4 : 0);
+		c = page[i + 4];				// 5
+		*bits7++ |= (c & 0x78) >> 3;
+		*bits7 = (c & 0x07) << 5;
 
-	on_error = get_error_for_screen_pixel(x + 1, y + 1, 1, fg, bg, sep);
-	off_error = get_error_for_screen_pixel(x + 1, y + 1, 0, fg, bg, sep);
-	min_char += (on_error < off_error ? 8 : 0);
+		c = page[i + 5];				// 6
+		*bits7++ |= (c & 0x7c) >> 2;
+		*bits7 = (c & 0x03) << 6;
 
-	on_error = get_error_for_screen_pixel(x, y + 2, 1, fg, bg, sep);
-	off_error = get_error_for_screen_pixel(x, y + 2, 0, fg, bg, sep);
-	min_char += (on_error < off_error ? 16 : 0);
+		c = page[i + 6];				// 7
+		*bits7++ |= (c & 0x7e) >> 1;
+		*bits7 = (c & 0x01) << 7;
 
-	on_error = get_error_for_screen_pixel(x + 1, y + 2, 1, fg, bg, sep);
-	off_error = get_error_for_screen_pixel(x + 1, y + 2, 0, fg, bg, sep);
-	min_char += (on_error < off_error ? 64 : 0);
+		c = page[i + 7];				// 8
+		*bits7++ |= (c & 0x7f);
+	}
 
-	return min_char;
+	char* base64 = (char*)malloc(4 + (MODE7_MAX_SIZE * 7) / 6);
+	/* keep track of our encoded position */
+	char* c = base64;
+	/* store the number of bytes encoded by a single call */
+	int cnt = 0;
+	/* we need an encoder state */
+	base64_encodestate s;
+
+	/*---------- START ENCODING ----------*/
+	/* initialise the encoder state */
+	base64_init_encodestate(&s);
+	/* gather data from the input and send it to the output */
+	cnt = base64_encode_block((const char *)mode77, (MODE7_MAX_SIZE * 7) / 8, c, &s);
+	c += cnt;
+	/* since we have encoded the entire input string, we know that
+	there is no more input data; finalise the encoding */
+	cnt = base64_encode_blockend(c, &s);
+	c += cnt;
+	/*---------- STOP ENCODING  ----------*/
+
+	/* we want to print the encoded data, so null-terminate it: */
+	*c = 0;
+
+	sprintf(url, "http://edit.tf/#0:%s", base64);
+
+	free(base64);
+	free(mode77);
 }
 
-int get_error_for_remainder_of_line(int x7, int y7, int fg, int bg, bool hold_mode, unsigned char last_gfx_char, bool sep)
+//
+// Batch mode - lots of images in one process across a pool of workers, each reusing one context
+//
+
+struct batch_settings
 {
-	if (x7 >= MODE7_WIDTH)
-		return 0;
+	const image2mode7_options *options;
+	const char *output_dir;
+	const char *cache_dir;
+	bool inf;
+	bool url;
+};
 
-	int state = GET_STATE(fg, bg, hold_mode, last_gfx_char, sep);
+struct batch_image
+{
+	std::string input_name;
+	std::string output_name;
+	int size;
+	int frame_error;
+	bool cached;
+	double seconds;
+};
 
-	if (total_error_in_state[state][x7] != -1)
-		return total_error_in_state[state][x7];
+static bool is_image_filename(const char *name)
+{
+	static const char *extensions[] = { ".png", ".jpg", ".jpeg", ".bmp", ".gif", ".ppm", ".pgm", ".pnm", ".tga", ".tif", ".tiff" };
 
-	//	printf("get_error_for_remainder_of_line(%d, %d, %d, %d, %d, %d)\n", x7, y7, fg, bg, hold_char, prev_char);
+	const char *dot = strrchr(name, '.');
 
-	unsigned char graphic_char = global_try_all ? 'Y' : get_graphic_char_from_image(x7, y7, fg, bg, sep);
-	int lowest_error = INT_MAX;
-	unsigned char lowest_char = 'Z';
+	if (!dot)
+		return false;
 
-	// Possible characters are: 1 + 1 + 6 + 1 + 1 + 1 + 1 = 12 possibilities x 40 columns = 12 ^ 40 combinations.  That's not going to work :)
-	// Possible states for a given cell: fg=0-7, bg=0-7, hold_gfx=6 pixels : total = 12 bits = 4096 possible states
-	// Wait! What about prev_char as part of state if want to use hold graphics feature? prev_char=6 pixels so actually 18 bits = 262144 possible states
-	// Not all of them can be visited as we cannot arbitrarily set the previous character or hold character but still needs a 40Mb array of ints! :S
+	for (int e = 0; e < (int)(sizeof(extensions) / sizeof(extensions[0])); e++)
+	{
+		if (cimg::strcasecmp(dot, extensions[e]) == 0)
+			return true;
+	}
 
-	// Graphic char (if set)
-	// Stay blank (if not)
-	// Set graphic colour (colour != fg) x6
-	// Fill (if bg != fg)
-	// No fill (if bg != 0)
-	// Hold graphics (if hold_mode == false)
-	// Release graphics (if hold_mode == true)
+	return false;
+}
 
-	// Always try a blank first
-	if (MODE7_BLANK)
-	{
-		int newstate = GET_STATE(fg, bg, hold_mode, MODE7_BLANK, sep);
-		int error = get_error_for_char(x7, y7, MODE7_BLANK, fg, bg, hold_mode, MODE7_BLANK, sep);
-		int remaining = get_error_for_remainder_of_line(x7 + 1, y7, fg, bg, hold_mode, MODE7_BLANK, sep);
+// Files (not directories) matching a wildcard pattern
+static void glob_files(const char *pattern, std::vector<std::string> *names)
+{
+#ifdef _WIN32
+	// FindFirstFile only gives back the name part
+	std::string dir(pattern);
+	size_t slash = dir.find_last_of("/\\");
+	dir = (slash == std::string::npos) ? "" : dir.substr(0, slash + 1);
 
-		if (total_error_in_state[newstate][x7 + 1] == -1)
-		{
-			total_error_in_state[newstate][x7 + 1] = remaining;
-			char_for_xpos_in_state[newstate][x7 + 1] = output[x7 + 1];
-		}
+	WIN32_FIND_DATAA data;
+	HANDLE find = FindFirstFileA(pattern, &data);
 
-		error += remaining;
+	if (find == INVALID_HANDLE_VALUE)
+		return;
 
-		if (error < lowest_error)
+	do
+	{
+		if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
 		{
-			lowest_error = error;
-			lowest_char = MODE7_BLANK;
+			names->push_back(dir + data.cFileName);
 		}
-	}
+	} while (FindNextFileA(find, &data));
 
-	// If the background is black we could enable fill! - you idiot - can enable fill at any time if fg colour has changed since last time!
-	if (global_use_fill)
+	FindClose(find);
+#else
+	glob_t found;
+
+	if (glob(pattern, 0, NULL, &found) == 0)
 	{
-		if (bg != fg)
+		for (size_t i = 0; i < found.gl_pathc; i++)
 		{
-			// Bg colour becomes fg colour immediately in this cell
-			int newstate = GET_STATE(fg, fg, hold_mode, last_gfx_char, sep);
-			int error = get_error_for_char(x7, y7, MODE7_NEW_BG, fg, fg, hold_mode, last_gfx_char, sep);
-			int remaining = get_error_for_remainder_of_line(x7 + 1, y7, fg, fg, hold_mode, last_gfx_char, sep);
+			struct stat info;
 
-			if (total_error_in_state[newstate][x7 + 1] == -1)
+			if (stat(found.gl_pathv[i], &info) == 0 && !(info.st_mode & S_IFDIR))
 			{
-				total_error_in_state[newstate][x7 + 1] = remaining;
-				char_for_xpos_in_state[newstate][x7 + 1] = output[x7 + 1];
+				names->push_back(found.gl_pathv[i]);
 			}
+		}
+	}
 
-			error += remaining;
+	globfree(&found);
+#endif
+}
 
-			if (error < lowest_error)
+// Source is a wildcard pattern, a directory (every image in it) or a manifest file (one image per line, # for comments)
+static void get_batch_image_names(const char *source, std::vector<std::string> *names)
+{
+	struct stat info;
+
+	if (strpbrk(source, "*?"))
+	{
+		glob_files(source, names);
+	}
+	else if (stat(source, &info) == 0 && (info.st_mode & S_IFDIR))
+	{
+		std::vector<std::string> files;
+		glob_files((std::string(source) + "/*").c_str(), &files);
+
+		for (size_t i = 0; i < files.size(); i++)
+		{
+			if (is_image_filename(files[i].c_str()))
 			{
-				lowest_error = error;
-				lowest_char = MODE7_NEW_BG;
+				names->push_back(files[i]);
 			}
 		}
+	}
+	else
+	{
+		FILE *file = fopen(source, "r");
 
-		// If the background is not black we could disable fill!
-		if (bg != 0)
-		{
-			// Bg colour becomes black immediately in this cell
-			int newstate = GET_STATE(fg, 0, hold_mode, last_gfx_char, sep);
-			int error = get_error_for_char(x7, y7, MODE7_BLACK_BG, fg, 0, hold_mode, last_gfx_char, sep);
-			int remaining = get_error_for_remainder_of_line(x7 + 1, y7, fg, 0, hold_mode, last_gfx_char, sep);
+		if (!file)
+			return;
 
-			if (total_error_in_state[newstate][x7 + 1] == -1)
-			{
-				total_error_in_state[newstate][x7 + 1] = remaining;
-				char_for_xpos_in_state[newstate][x7 + 1] = output[x7 + 1];
-			}
+		char line[1024];
 
-			error += remaining;
+		while (fgets(line, sizeof(line), file))
+		{
+			line[strcspn(line, "\r\n")] = '\0';
 
-			if (error < lowest_error)
+			if (line[0] && line[0] != '#')
 			{
-				lowest_error = error;
-				lowest_char = MODE7_BLACK_BG;
+				names->push_back(line);
 			}
 		}
+
+		fclose(file);
+		return;
 	}
 
-	// We could enter seperated graphics mode?
-	if (global_use_sep)
-	{
-		if (!sep)
-		{
-			int newstate = GET_STATE(fg, bg, hold_mode, last_gfx_char, true);
-			int error = get_error_for_char(x7, y7, MODE7_SEP_GFX, fg, bg, hold_mode, last_gfx_char, true);
-			int remaining = get_error_for_remainder_of_line(x7 + 1, y7, fg, bg, hold_mode, last_gfx_char, true);
+	// Manifests keep their order, everything else is sorted so output is the same every time
+	std::sort(names->begin(), names->end());
+}
 
-			if (total_error_in_state[newstate][x7 + 1] == -1)
-			{
-				total_error_in_state[newstate][x7 + 1] = remaining;
-				char_for_xpos_in_state[newstate][x7 + 1] = output[x7 + 1];
-			}
+// Output goes next to the input or into output_dir by the input's file name (also for URLs in a manifest)
+// Names already used get a number before the .bin so images with the same file name don't overwrite each other
+static std::string get_batch_output_name(const batch_settings *settings, const std::string &input_name, std::set<std::string> *used)
+{
+	std::string name = input_name;
 
-			error += remaining;
+	if (settings->output_dir)
+	{
+		size_t slash = input_name.find_last_of("/\\");
+		name = std::string(settings->output_dir) + "/" + ((slash == std::string::npos) ? input_name : input_name.substr(slash + 1));
+	}
 
-			if (error < lowest_error)
-			{
-				lowest_error = error;
-				lowest_char = MODE7_SEP_GFX;
-			}
-		}
-		
-		// We could go back to contiguous graphics...
-		else
-		{
-			int newstate = GET_STATE(fg, bg, hold_mode, last_gfx_char, false);
-			int error = get_error_for_char(x7, y7, MODE7_CONTIG_GFX, fg, bg, hold_mode, last_gfx_char, false);
-			int remaining = get_error_for_remainder_of_line(x7 + 1, y7, fg, bg, hold_mode, last_gfx_char, false);
+	std::string output_name = name + ".bin";
 
-			if (total_error_in_state[newstate][x7 + 1] == -1)
-			{
-				total_error_in_state[newstate][x7 + 1] = remaining;
-				char_for_xpos_in_state[newstate][x7 + 1] = output[x7 + 1];
-			}
+	for (int n = 2; ; n++)
+	{
+		// Case doesn't matter on Windows
+		std::string key = output_name;
+		std::transform(key.begin(), key.end(), key.begin(), ::tolower);
 
-			error += remaining;
+		if (used->insert(key).second)
+		{
+			if (n > 2)
+				printf("'%s' has the same output name as an earlier image - writing '%s'\n", input_name.c_str(), output_name.c_str());
 
-			if (error < lowest_error)
-			{
-				lowest_error = error;
-				lowest_char = MODE7_CONTIG_GFX;
-			}
+			return output_name;
 		}
+
+		output_name = name + "." + std::to_string(n) + ".bin";
 	}
+}
+
+static void batch_thread(const batch_settings *settings, std::vector<batch_image> *images, std::atomic<int> *next_image, std::mutex *print_mutex)
+{
+	image2mode7_context *context = image2mode7_create(settings->options);
+
+	unsigned char page[IMAGE2MODE7_MAX_PAGE_SIZE];
+	char url[EDITTF_URL_SIZE];
 
-	// We could enter hold graphics mode!
-	if (global_use_hold)
+	int count = (int)images->size();
+
+	for (int i = (*next_image)++; i < count; i = (*next_image)++)
 	{
-		if (!hold_mode)
+		batch_image *image = &(*images)[i];
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		try
+		{
+			image->size = convert_image_file(context, settings->options, image->input_name.c_str(), settings->cache_dir, page, &image->frame_error, &image->cached);
+		}
+		catch (CImgException &)
+		{
+			image->size = -1;
+		}
+
+		bool written = false;
+		const std::string &output_name = image->output_name;
+
+		if (image->size > 0)
 		{
-			int newstate = GET_STATE(fg, bg, true, last_gfx_char, sep);
-			int error = get_error_for_char(x7, y7, MODE7_HOLD_GFX, fg, bg, true, last_gfx_char, sep);			// hold control code does adopt last graphic character immediately
-			int remaining = get_error_for_remainder_of_line(x7 + 1, y7, fg, bg, true, last_gfx_char, sep);
+			written = write_file(output_name.c_str(), page, image->size);
 
-			if (total_error_in_state[newstate][x7 + 1] == -1)
+			if (written && settings->inf)
 			{
-				total_error_in_state[newstate][x7 + 1] = remaining;
-				char_for_xpos_in_state[newstate][x7 + 1] = output[x7 + 1];
+				size_t slash = output_name.find_last_of("/\\");
+				write_inf_file((output_name + ".inf").c_str(), output_name.c_str() + (slash == std::string::npos ? 0 : slash + 1));
 			}
 
-			error += remaining;
-
-			if (error < lowest_error)
+			if (written && settings->url)
 			{
-				lowest_error = error;
-				lowest_char = MODE7_HOLD_GFX;
+				get_edittf_url(page, url);
+				write_file((output_name + ".url").c_str(), (const unsigned char *)url, (int)strlen(url));
 			}
 		}
 
-		// We could exit hold graphics mode..
+		image->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::lock_guard<std::mutex> lock(*print_mutex);
+
+		if (image->size <= 0)
+		{
+			printf("[%d/%d] '%s' could not be converted\n", i + 1, count, image->input_name.c_str());
+		}
+		else if (!written)
+		{
+			printf("[%d/%d] '%s' could not be written\n", i + 1, count, output_name.c_str());
+			image->size = -1;
+		}
+		else if (image->cached)
+		{
+			printf("[%d/%d] '%s' from cache %.1f ms\n", i + 1, count, image->input_name.c_str(), image->seconds * 1000.0);
+		}
 		else
 		{
-			int newstate = GET_STATE(fg, bg, false, MODE7_BLANK, sep);
-			int error = get_error_for_char(x7, y7, MODE7_RELEASE_GFX, fg, bg, false, MODE7_BLANK, sep);
-			int remaining = get_error_for_remainder_of_line(x7 + 1, y7, fg, bg, false, MODE7_BLANK, sep);
+			printf("[%d/%d] '%s' error=%d %.1f ms\n", i + 1, count, image->input_name.c_str(), image->frame_error, image->seconds * 1000.0);
+		}
+	}
 
-			if (total_error_in_state[newstate][x7 + 1] == -1)
-			{
-				total_error_in_state[newstate][x7 + 1] = remaining;
-				char_for_xpos_in_state[newstate][x7 + 1] = output[x7 + 1];
-			}
+	image2mode7_destroy(context);
+}
 
-			error += remaining;
+// Returns the number of images that failed
+static int convert_batch(const char *source, const batch_settings *settings, int num_jobs)
+{
+	std::vector<std::string> names;
+	get_batch_image_names(source, &names);
 
-			if (error < lowest_error)
-			{
-				lowest_error = error;
-				lowest_char = MODE7_RELEASE_GFX;
-			}
-		}
+	std::vector<batch_image> images(names.size());
+	std::set<std::string> used_names;
+
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		images[i].input_name = names[i];
+		images[i].output_name = get_batch_output_name(settings, names[i], &used_names);
+		images[i].size = 0;
+		images[i].frame_error = 0;
+		images[i].cached = false;
+		images[i].seconds = 0.0;
 	}
 
-	for (int c = 1; c < 8; c++)
+	if (num_jobs <= 0)
 	{
-		// We could change our fg colour!
-		if (c != fg)
-		{
-			int newstate = GET_STATE(c, bg, hold_mode, last_gfx_char, sep);
+		num_jobs = (int)std::thread::hardware_concurrency();
+	}
 
-			// The fg colour doesn't actually take effect until next cell - so any hold char here will be in current fg colour
-			int error = get_error_for_char(x7, y7, MODE7_GFX_COLOUR + c, fg, bg, hold_mode, last_gfx_char, sep);			// old state
+	// No point in more workers than images
+	if (num_jobs > (int)images.size())
+	{
+		num_jobs = (int)images.size();
+	}
 
-			int remaining = get_error_for_remainder_of_line(x7 + 1, y7, c, bg, hold_mode, last_gfx_char, sep);			// new state
+	if (num_jobs < 1)
+	{
+		num_jobs = 1;
+	}
 
-			if (total_error_in_state[newstate][x7 + 1] == -1)
-			{
-				total_error_in_state[newstate][x7 + 1] = remaining;
-				char_for_xpos_in_state[newstate][x7 + 1] = output[x7 + 1];
-			}
+	printf("Converting %d images from '%s' with %d workers...\n", (int)images.size(), source, num_jobs);
 
-			error += remaining;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-			if (error < lowest_error)
-			{
-				lowest_error = error;
-				lowest_char = MODE7_GFX_COLOUR + c;
-			}
-		}
-	}
+	std::atomic<int> next_image(0);
+	std::mutex print_mutex;
+	std::vector<std::thread> threads;
 
-	if (global_try_all)
+	for (int t = 0; t < num_jobs; t++)
 	{
-		// Try every possible graphic character...
+		threads.push_back(std::thread(batch_thread, settings, &images, &next_image, &print_mutex));
+	}
 
-		for (int i = 1; i < 64; i++)
-		{
-			graphic_char = (MODE7_BLANK) | (i & 0x1f) | ((i & 0x20) << 1);
+	for (size_t t = 0; t < threads.size(); t++)
+	{
+		threads[t].join();
+	}
 
-			int newstate = GET_STATE(fg, bg, hold_mode, global_use_hold ? graphic_char : MODE7_BLANK, sep);
-			int error = get_error_for_char(x7, y7, graphic_char, fg, bg, hold_mode, global_use_hold ? graphic_char : MODE7_BLANK, sep);
-			int remaining = get_error_for_remainder_of_line(x7 + 1, y7, fg, bg, hold_mode, global_use_hold ? graphic_char : MODE7_BLANK, sep);
+	double wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-			if (total_error_in_state[newstate][x7 + 1] == -1)
-			{
-				total_error_in_state[newstate][x7 + 1] = remaining;
-				char_for_xpos_in_state[newstate][x7 + 1] = output[x7 + 1];
-			}
+	//
+	// Summary
+	//
 
-			error += remaining;
+	int converted = 0, cached = 0, failed = 0;
+	double total_seconds = 0.0;
+	long long total_error = 0;
+	const batch_image *slowest = NULL;
+	const batch_image *worst = NULL;
 
-			if (error < lowest_error)
-			{
-				lowest_error = error;
-				lowest_char = graphic_char;
-			}
-		}
-	}
-	else
+	for (size_t i = 0; i < images.size(); i++)
 	{
-		// Try our graphic character (if it's not blank)
+		const batch_image *image = &images[i];
 
-		if (graphic_char != MODE7_BLANK)
+		if (image->size <= 0)
 		{
-			int newstate = GET_STATE(fg, bg, hold_mode, global_use_hold ? graphic_char : MODE7_BLANK, sep);
-			int error = get_error_for_char(x7, y7, graphic_char, fg, bg, hold_mode, global_use_hold ? graphic_char : MODE7_BLANK, sep);
-			int remaining = get_error_for_remainder_of_line(x7 + 1, y7, fg, bg, hold_mode, global_use_hold ? graphic_char : MODE7_BLANK, sep);
+			failed++;
+			continue;
+		}
 
-			if (total_error_in_state[newstate][x7 + 1] == -1)
-			{
-				total_error_in_state[newstate][x7 + 1] = remaining;
-				char_for_xpos_in_state[newstate][x7 + 1] = output[x7 + 1];
-			}
+		total_seconds += image->seconds;
 
-			error += remaining;
+		if (!slowest || image->seconds > slowest->seconds) slowest = image;
 
-			if (error < lowest_error)
-			{
-				lowest_error = error;
-				lowest_char = graphic_char;
-			}
+		// Frame error isn't known for pages from the cache
+		if (image->cached)
+		{
+			cached++;
+			continue;
 		}
-	}
-	//	printf("(%d, %d) returning char=%d lowest error=%d\n", x7, y7, lowest_char, lowest_error);
 
-	output[x7] = lowest_char;
+		converted++;
+		total_error += image->frame_error;
 
-	return lowest_error;
-}
+		if (!worst || image->frame_error > worst->frame_error) worst = image;
+	}
 
-int match_closest_palette_colour(unsigned char r, unsigned char g, unsigned char b)
-{
-	int min_error = INT_MAX;
-	int min_colour = -1;
+	printf("Batch of %d images: %d converted, %d from cache, %d failed in %.2f s (%.1f images/s)\n", (int)images.size(), converted, cached, failed, wall_seconds, wall_seconds > 0.0 ? (converted + cached) / wall_seconds : 0.0);
 
-	for (int c = 0; c < 8; c++)
+	if (slowest)
 	{
-		unsigned char cr = GET_RED_FROM_COLOUR(c);
-		unsigned char cg = GET_GREEN_FROM_COLOUR(c);
-		unsigned char cb = GET_BLUE_FROM_COLOUR(c);
-
-		int error = ((cr - r) * (cr - r)) + ((cg - g) * (cg - g)) + ((cb - b) * (cb - b));
+		printf("Time per image: mean %.1f ms, slowest %.1f ms '%s'\n", 1000.0 * total_seconds / (converted + cached), 1000.0 * slowest->seconds, slowest->input_name.c_str());
+	}
 
-		if (error < min_error)
-		{
-			min_error = error;
-			min_colour = c;
-		}
+	if (worst)
+	{
+		printf("Frame error: total %lld, mean %lld, worst %d '%s'\n", total_error, total_error / converted, worst->frame_error, worst->input_name.c_str());
 	}
 
-	return min_colour;
+	return failed;
 }
 
 int main(int argc, char **argv)
@@ -722,22 +1007,75 @@ int main(int argc, char **argv)
 	const bool url = cimg_option("-url", false, "Spit out URL for edit.tf");
 	const bool error_lookup = cimg_option("-lookup", false, "*EXPERIMENTAL* Use lookup table for colour error (default is geometric distance)");
 	const bool try_all = cimg_option("-slow", false, "Calculate full line error for every possible graphics character (64x slower)");
+	const bool best_first = cimg_option("-astar", false, "Best-first (A*) search for each row - same result, usually far fewer states (best with -slow)");
+	const int beam_width = cimg_option("-beam", 0, "Beam search keeping the K best states per column - fixed time per row at some cost in quality (0 = exact)");
+	const bool no_simd = cimg_option("-nosimd", false, "Don't use SSE4.1/AVX2 kernels for pixel pattern errors even if the CPU has them");
+	const int num_threads = cimg_option("-threads", 1, "Number of threads to solve rows with (0 = one per CPU core)");
+	const bool dense_memo = cimg_option("-dense", false, "Use dense error tables for every possible state rather than just those reached (more memory)");
+	const int memo_scale = cimg_option("-memoscale", 1, "Divide errors in the 16-bit dense tables by this - 1 gives the same page as without -dense, bigger saturates less but is less precise");
+	const int row_cache_rows = cimg_option("-rowcache", 1024, "Remember this many solved rows and reuse them for rows with identical pixels (0 = off)");
+	const char *const cache_dir = cimg_option("-cache", (char*)0, "Directory of converted pages to reuse when the same image file is converted with the same options - a hit skips decoding it");
 	const int dither = cimg_option("-dither", 0, "Enable ordered dithering (2=2x2 3=3x3 4=4x4 5=2x3 matrix)");
 	const bool load = cimg_option("-load", false, "Load MODE 7 bin file not the image!");
 	const char *const decode_string = cimg_option("-decode", (char*)0, "Decode edit.tf URL not the image!");
+	const char *const batch_source = cimg_option("-batch", (char*)0, "Convert a directory, wildcard pattern or list file of images (-o is the output directory)");
+	const int num_jobs = cimg_option("-jobs", 0, "Number of images to convert at once in batch mode (0 = one per CPU core)");
 
 	char filename[256];
 	FILE *file;
 
 	if (cimg_option("-h", false, 0)) std::exit(0);
 
-	global_use_hold = !no_hold;
-	global_use_fill = !no_fill;
-	global_use_sep = use_sep;
-	global_sep_fg_factor = sep_factor;
+	image2mode7_options options;
+	image2mode7_default_options(&options);
+
+	options.no_scale = no_scale;
+	options.dither = dither;
+	options.use_quant = use_quant;
+	options.sat = sat;
+	options.value = value;
+	options.black = black;
+	options.white = white;
+
+	options.use_hold = !no_hold;
+	options.use_fill = !no_fill;
+	options.use_sep = use_sep;
+	options.sep_fg_factor = sep_factor;
+	options.use_geometric = !error_lookup;
+	options.try_all = try_all;
+	options.use_dense_memo = dense_memo;
+	options.memo_scale = memo_scale;
+	options.use_best_first = best_first;
+	options.beam_width = beam_width;
+	options.use_simd = !no_simd;
+	options.num_threads = num_threads;
+	options.row_cache_rows = row_cache_rows;
+
+	options.verbose = verbose;
+	options.show_progress = true;
+	options.test_image_name = simg ? input_name : NULL;
+
+	//
+	// Batch!
+	//
+	if (batch_source)
+	{
+		// Per image diagnostics would be all mixed up between the workers
+		options.verbose = false;
+		options.show_progress = false;
+		options.test_image_name = NULL;
+
+		cimg::exception_mode(0);
 
-	global_use_geometric = !error_lookup;
-	global_try_all = try_all;
+		batch_settings settings;
+		settings.options = &options;
+		settings.output_dir = output_name;
+		settings.cache_dir = cache_dir;
+		settings.inf = inf;
+		settings.url = url;
+
+		return convert_batch(batch_source, &settings, num_jobs) ? 1 : 0;
+	}
 
 	//
 	// Decode!
@@ -855,406 +1193,16 @@ int main(int argc, char **argv)
 	//
 	else
 	{
-		if (verbose) {
-			printf("Loading image file '%s'...\n", input_name);
-		}
-
-		src.assign(input_name);
-
-		//
-		// Resize!
-		//
-
-		int pixel_width, pixel_height;
-
-		if (no_scale)
-		{
-			if (verbose)
-			{
-				printf("Leaving size as %d x %d pixels...\n", src._width, src._height);
-			}
-
-			pixel_width = src._width;
-			pixel_height = src._height;
-		}
-		else
-		{
-			// Calculate frame size - adjust to width
-			pixel_width = (MODE7_WIDTH - FRAME_FIRST_COLUMN) * 2;
-			pixel_height = pixel_width * IMAGE_H / IMAGE_W;
-			if (pixel_height % 3) pixel_height += (3 - (pixel_height % 3));
-
-			// Adjust to height
-			if (pixel_height > MODE7_PIXEL_H)
-			{
-				pixel_height = MODE7_PIXEL_H;
-				pixel_width = pixel_height * IMAGE_W / IMAGE_H;
-
-				if (pixel_width % 1) pixel_width++;
-
-				// Need to handle reset of background if frame_width < MODE7_WIDTH
-			}
-
-			// Resize image to this size
-
-			if (verbose)
-			{
-				printf("Resizing from %d x %d to %d x %d pixels...\n", src._width, src._height, pixel_width, pixel_height);
-			}
-
-			src.resize(pixel_width, pixel_height);
-
-			// Save test images for debug
-
-			if (simg)
-			{
-				if (verbose)
-				{
-					printf("Saving test image '%s_small.png'...\n", input_name);
-				}
-
-				sprintf(filename, "%s_small.png", input_name);
-				src.save(filename);
-			}
-		}
-
-		//
-		// Dithering!
-		//
-
-		if (dither > 1 && dither <= 5)
-		{
-			int modx = dither, mody = dither;
-
-			if (dither == 5)
-			{
-				modx = 2;
-				mody = 3;
-			}
-
-			int divisor = 2 * ((modx * mody) + 1);
-			int subtract = divisor / 2;
-			int *table = NULL;
-
-			if (verbose)
-			{
-				printf("Ordered dither %dx%d (divisor=%d subtract=%d)...\n", modx, mody, divisor, subtract);
-			}
-
-			switch (dither)
-			{
-			case 2:
-				table = dither2;
-				break;
-
-			case 3:
-				table = dither3;
-				break;
-
-			case 4:
-				table = dither4;
-				break;
-
-			case 5:
-				table = dither23;
-				break;
-
-			default:
-				break;
-			}
-
-			cimg_forXY(src, x, y)
-			{
-				int image_r = src(x, y, 0);
-				int image_g = src(x, y, 1);
-				int image_b = src(x, y, 2);
+		image2mode7_context *context = image2mode7_create(&options);
 
-				image_r = src(x, y, 0) + 254 * (table[(x % modx) + (y % mody) * modx] - subtract) / divisor;
-				image_r = MIN(image_r, 255);
-				image_r = MAX(image_r, 0);
+		int frame_error;
+		bool cached;
+		int size = convert_image_file(context, &options, input_name, cache_dir, mode7, &frame_error, &cached);
 
-				image_g = src(x, y, 1) + 254 * (table[(x % modx) + (y % mody) * modx] - subtract) / divisor;
-				image_g = MIN(image_g, 255);
-				image_g = MAX(image_g, 0);
+		image2mode7_destroy(context);
 
-				image_b = src(x, y, 2) + 254 * (table[(x % modx) + (y % mody) * modx] - subtract) / divisor;
-				image_b = MIN(image_b, 255);
-				image_b = MAX(image_b, 0);
-
-				src(x, y, 0) = image_r;
-				src(x, y, 1) = image_g;
-				src(x, y, 2) = image_b;
-			}
-
-			// Save test images for debug
-
-			if (simg)
-			{
-				if (verbose)
-				{
-					printf("Saving test image '%s_dither.png'...\n", input_name);
-				}
-
-				sprintf(filename, "%s_dither.png", input_name);
-				src.save(filename);
-			}
-		}
-
-		//
-		// Colour conversion etc.
-		//
-
-		if (!use_quant)
-		{
-			if (verbose)
-			{
-				printf("Skipping conversion to MODE 7 palette...\n");
-			}
-		}
-		else
-		{
-			if (verbose)
-			{
-				printf("Converting to MODE 7 palette...\n");
-			}
-
-			// Convert to HSV
-
-			cimg_forXY(src, x, y)
-			{
-				unsigned char R = src(x, y, 0);
-				unsigned char G = src(x, y, 1);
-				unsigned char B = src(x, y, 2);
-
-				unsigned char r, g, b;
-				r = g = b = 0;
-
-				unsigned char M = MAX_3(R, G, B);
-				unsigned char m = MIN_3(R, G, B);
-
-				unsigned char C = M - m;				// Chroma - black to white
-
-				unsigned char Hc = 0;					// Hue - as BBC colour palette
-
-				if (C != 0)
-				{
-					if (M == R)
-					{
-						int h = 255 * (G - B) / C;
-
-						if (h > 127) Hc = 3;			// yellow
-						else if (h < -128) Hc = 5;		// magenta
-						else Hc = 1;					// red
-					}
-					else if (M == G)
-					{
-						int h = 255 * (B - R) / C;
-
-						if (h > 127) Hc = 6;			// cyan
-						else if (h < -128) Hc = 3;		// yellow
-						else Hc = 2;					// green
-					}
-					else if (M == B)
-					{
-						int h = 255 * (R - G) / C;
-
-						if (h > 127) Hc = 5;			// magenta
-						else if (h < -128) Hc = 6;		// cyan
-						else Hc = 2;					// blue
-					}
-				}
-
-				unsigned char Y = (unsigned char)(0.2126f * R + 0.7152f * G + 0.0722f * B);		// Luma (screen brightess)
-
-				unsigned char V = M;					// Value
-
-				int S = 0;								// Saturation
-
-				if (C != 0)
-				{
-					S = 255 * C / V;
-				}
-
-				// If saturation too low assume grey
-
-				if (S < sat)
-				{
-					// Grey
-					// Adjust colour palette for grey scale
-					// Map value to colour ramp - change RAMP!
-
-					unsigned char Gc = 0;
-					int midpoint = (white - black) / 2;
-
-					if (V < black)
-						Gc = 0;
-					else if (V < (black + midpoint))
-						Gc = 4;			// blue
-					else if (V < white)
-						Gc = 6;			// cyan
-					else
-						Gc = 7;			// white		// could use yellow?
-
-					r = GET_RED_FROM_COLOUR(Gc);
-					g = GET_GREEN_FROM_COLOUR(Gc);
-					b = GET_BLUE_FROM_COLOUR(Gc);
-				}
-				else
-				{
-					// Colour
-					// If Value is too low then assume black
-
-					if (V < value)
-					{
-						// Black
-						r = g = b = 0;
-					}
-					else
-					{
-						// Not black = full colour
-
-						int c = match_closest_palette_colour(R, G, B);
-
-						r = GET_RED_FROM_COLOUR(c);
-						g = GET_GREEN_FROM_COLOUR(c);
-						b = GET_BLUE_FROM_COLOUR(c);
-					}
-				}
-
-				src(x, y, 0) = r;
-				src(x, y, 1) = g;
-				src(x, y, 2) = b;
-			}
-
-			//
-			// Save output of colour conversion for debug
-			//
-
-			if (simg)
-			{
-				if (verbose)
-				{
-					printf("Saving test image '%s_quant.png'...\n", input_name);
-				}
-
-				sprintf(filename, "%s_quant.png", input_name);
-				src.save(filename);
-			}
-		}
-
-		//
-		// Conversion to MODE 7
-		//
-
-		int frame_error = 0;
-
-		frame_width = pixel_width / 2;
-		frame_height = pixel_height / 3;
-
-		if (verbose)
-		{
-			printf("Converting to MODE 7 screen size %d x %d...\n", frame_width, frame_height);
-		}
-
-		// Set everything to blank
-		memset(mode7, MODE7_BLANK, MODE7_MAX_SIZE);
-
-		for (int y7 = 0; y7 < frame_height; y7++)
-		{
-			int y = IMAGE_Y_FROM_Y7(y7);
-
-			// Reset state as starting new character row
-			// State = fg colour + bg colour + hold character + prev character
-			// For each character cell on this line
-			// Do we have pixels or not?
-			// If we have pixels then need to decide whether is it better to replace this cell with a control code or keep pixels
-			// Possible control codes are: new fg colour, fill (bg colour = fg colour), no fill (bg colour = black), hold graphics (hold char = prev char), release graphics (hold char = empty)
-			// "Better" means that the "error" for the rest of the line (appearance on screen vs actual image = deviation) is minimised
-
-			// Clear our array of error values for each state & x position
-			clear_error_char_arrays();
-
-			int min_error = INT_MAX;
-			int min_colour = 0;
-
-			// Determine best initial state for line
-			for (int fg = 7; fg > 0; fg--)
-			{
-				// What would our first character look like in this state?
-				unsigned char first_char = get_graphic_char_from_image(FRAME_FIRST_COLUMN, y7, fg, 0, false);
-
-				// What's the error for that character?
-				int error = get_error_for_char(FRAME_FIRST_COLUMN, y7, first_char, fg, 0, false, MODE7_BLANK, false);
-
-				// Find the lowest error corresponding to our possible start states
-				if (error < min_error)
-				{
-					min_error = error;
-					min_colour = fg;
-				}
-			}
-
-			// This is our initial state of the line
-			int state = GET_STATE(min_colour, 0, false, MODE7_BLANK, false);
-
-			if (verbose)
-			{
-				printf("[%d] Start colour=%d ", y7, min_colour);
-			}
-			else
-			{
-				printf("\rProcessing line %d/%d...", y7, frame_height);
-			}
-
-			// Set this state before frame begins
-			mode7[(y7 * MODE7_WIDTH) + (FRAME_FIRST_COLUMN - 1)] = MODE7_GFX_COLOUR + min_colour;
-
-			// Kick off recursive error calculation with that state
-			int error = get_error_for_remainder_of_line(FRAME_FIRST_COLUMN, y7, min_colour, 0, false, MODE7_BLANK, false);
-
-			if (verbose)
-			{
-				printf("Line error=%d\n", error);
-			}
-
-			frame_error += error;
-
-			// Store first character
-			char_for_xpos_in_state[state][FRAME_FIRST_COLUMN] = output[FRAME_FIRST_COLUMN];
-
-			// Copy the resulting character data into MODE 7 screen
-			for (int x7 = FRAME_FIRST_COLUMN; x7 < (FRAME_FIRST_COLUMN + FRAME_WIDTH); x7++)
-			{
-				// Copy character chosen in this position for this state
-				unsigned char best_char = char_for_xpos_in_state[state][x7];
-
-				mode7[(y7 * MODE7_WIDTH) + (x7)] = best_char;
-
-				// Update the state
-				state = get_state_for_char(best_char, state);
-			}
-
-			// For when image is narrower than screen width
-
-			if (FRAME_FIRST_COLUMN + FRAME_WIDTH < MODE7_WIDTH)
-			{
-				mode7[(y7 * MODE7_WIDTH) + FRAME_FIRST_COLUMN + FRAME_WIDTH] = MODE7_BLACK_BG;
-			}
-
-			// printf("\n");
-
-			y += 2;
-		}
-
-		if (verbose)
-		{
-			printf("Total frame error = %d\n", frame_error);
-			printf("MODE 7 frame size = %d bytes\n", FRAME_SIZE);
-		}
-		else
-		{
-			printf("\n");
-		}
+		frame_width = MODE7_WIDTH;
+		frame_height = size > 0 ? size / MODE7_WIDTH : 0;
 	}
 
 	//
@@ -1269,7 +1217,7 @@ int main(int argc, char **argv)
 				printf("Writing MODE 7 frame '%s'...\n", output_name);
 			}
 
-			file = fopen(output_name, "wb");
+			write_file(output_name, mode7, FRAME_SIZE);
 		}
 		else
 		{
@@ -1279,13 +1227,7 @@ int main(int argc, char **argv)
 			}
 
 			sprintf(filename, "%s.bin", input_name);
-			file = fopen(filename, "wb");
-		}
-
-		if (file)
-		{
-			fwrite(mode7, 1, FRAME_SIZE, file);
-			fclose(file);
+			write_file(filename, mode7, FRAME_SIZE);
 		}
 	}
 
@@ -1310,104 +1252,21 @@ int main(int argc, char **argv)
 			sprintf(filename, "%s.bin.inf", input_name);
 		}
 
-		file = fopen((const char*)filename, "wb");
-
-		if (file)
-		{
-			char buffer[256];
-			char beeb_name[8];
-			if (output_name) {
-				strncpy(beeb_name, output_name, 7);
-			}
-			else {
-				strncpy(beeb_name, input_name, 7);
-			}
-			beeb_name[7] = '\0';
-			char* dot = strchr(beeb_name, '.');
-			if (dot != NULL) {
-				*dot = '\0';
-			}
-			sprintf(buffer, "$.%s      FF7C00 FF7C00\n", beeb_name);
-
-			fwrite(buffer, 1, strlen(buffer), file);
-			fclose(file);
-		}
+		write_inf_file(filename, output_name ? output_name : input_name);
 	}
 
 	if (url)
 	{
-		/* set up a destination buffer large enough to hold the encoded data */
-		unsigned char *mode77 = (unsigned char *)malloc((MODE7_MAX_SIZE * 7) / 8);
-		unsigned char *bits7 = mode77;
+		char edittf_url[EDITTF_URL_SIZE];
 
 		if (verbose)
 		{
 			printf("Calculating edit.tf URL...\n");
 		}
 
-		for (int i = 0; i < MODE7_MAX_SIZE; i+=8)
-		{
-			// 8 enter, 7 leave
-			unsigned char c;
-
-			c = mode7[i];					// 1
-			*bits7 = (c & 0x7f) << 1;
-
-			c = mode7[i + 1];				// 2
-			*bits7++ |= (c & 0x40) >> 6;
-			*bits7 = (c & 0x3f) << 2;
-
-			c = mode7[i + 2];				// 3
-			*bits7++ |= (c & 0x60) >> 5;
-			*bits7 = (c & 0x1f) << 3;
-
-			c = mode7[i + 3];				// 4
-			*bits7++ |= (c & 0x70) >> 4;
-			*bits7 = (c & 0x0f) << 4;
-
-			c = mode7[i + 4];				// 5
-			*bits7++ |= (c & 0x78) >> 3;
-			*bits7 = (c & 0x07) << 5;
-
-			c = mode7[i + 5];				// 6
-			*bits7++ |= (c & 0x7c) >> 2;
-			*bits7 = (c & 0x03) << 6;
-
-			c = mode7[i + 6];				// 7
-			*bits7++ |= (c & 0x7e) >> 1;
-			*bits7 = (c & 0x01) << 7;
-
-			c = mode7[i + 7];				// 8
-			*bits7++ |= (c & 0x7f);
-		}
-
-		char* base64 = (char*)malloc(4 + (MODE7_MAX_SIZE * 7) / 6);
-		/* keep track of our encoded position */
-		char* c = base64;
-		/* store the number of bytes encoded by a single call */
-		int cnt = 0;
-		/* we need an encoder state */
-		base64_encodestate s;
-
-		/*---------- START ENCODING ----------*/
-		/* initialise the encoder state */
-		base64_init_encodestate(&s);
-		/* gather data from the input and send it to the output */
-		cnt = base64_encode_block((const char *)mode77, (MODE7_MAX_SIZE * 7) / 8, c, &s);
-		c += cnt;
-		/* since we have encoded the entire input string, we know that
-		there is no more input data; finalise the encoding */
-		cnt = base64_encode_blockend(c, &s);
-		c += cnt;
-		/*---------- STOP ENCODING  ----------*/
+		get_edittf_url(mode7, edittf_url);
 
-		/* we want to print the encoded data, so null-terminate it: */
-		*c = 0;
-
-		printf("http://edit.tf/#0:%s\n", base64);
-
-		free(base64);
-		free(mode77);
+		printf("%s\n", edittf_url);
 	}
 	
 	return 0;
@@ -0,0 +1,3194 @@
+// libimage2mode7.cpp : MODE 7 conversion library - see libimage2mode7.h
+//
+// Generic image -> mode 7 (aka Teletext) conversion routine
+// Based on an initial algorithm by Puppeh (Julian Brown)
+//
+
+#include "targetver.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "CImg.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "libimage2mode7.h"
+
+using namespace cimg_library;
+
+#define MODE7_WIDTH			40
+#define MODE7_HEIGHT		25
+#define MODE7_MAX_SIZE		(MODE7_WIDTH * MODE7_HEIGHT)
+#define MODE7_MAX_HEIGHT	(IMAGE2MODE7_MAX_PAGE_SIZE / MODE7_WIDTH)
+
+#define IMAGE_W				(context->src._width)
+#define IMAGE_H				(context->src._height)
+
+#define MODE7_PIXEL_W		IMAGE2MODE7_PIXEL_WIDTH
+#define MODE7_PIXEL_H		IMAGE2MODE7_PIXEL_HEIGHT
+#define MODE7_MAX_PIXEL_H	(MODE7_MAX_HEIGHT * 3)		// no_scale frames can be taller
+
+#define FRAME_WIDTH			(context->frame_width)
+#define FRAME_HEIGHT		(context->frame_height)
+#define FRAME_SIZE			(MODE7_WIDTH * FRAME_HEIGHT)
+#define FRAME_FIRST_COLUMN	1				// (MODE7_WIDTH - FRAME_WIDTH)
+
+#define MODE7_BLANK			32
+#define MODE7_BLACK_BG		156
+#define MODE7_NEW_BG		157
+#define MODE7_HOLD_GFX		158
+#define MODE7_RELEASE_GFX	159
+#define MODE7_GFX_COLOUR	144
+#define MODE7_CONTIG_GFX	153
+#define MODE7_SEP_GFX		154
+
+#define CLAMP(a,low,high)	((a) < (low) ? (low) : ((a) > (high) ? (high) : (a)))
+#define THRESHOLD(a,t)		((a) >= (t) ? 255 : 0)
+
+// Solver option flags - the row solver is compiled for every combination of these and the one to use is picked once per conversion
+
+#define SOLVER_FILL			(1 << 0)
+#define SOLVER_SEP			(1 << 1)
+#define SOLVER_HOLD			(1 << 2)
+#define SOLVER_TRY_ALL		(1 << 3)
+#define SOLVER_DENSE		(1 << 4)
+#define SOLVER_GEOMETRIC	(1 << 5)
+#define SOLVER_NUM_VARIANTS	(1 << 6)
+
+// State = fg colour (3 bits) + bg colour (3) + hold mode (1) + held char as a sixel index (6) + separated mode (1)
+// The held char can only ever be one of the 64 graphic chars (blank is index 0) and without hold it is always blank,
+// so the sep bit goes straight after the fields the solver flags actually use to keep the state space as small as possible
+
+#define MAX_STATE			(1U << 14)
+
+#define STATE_SEP_SHIFT(flags)	(((flags) & SOLVER_HOLD) ? 13 : 6)
+#define GET_STATE(flags,fg,bg,hold_mode,last_gfx_index,sep)	( (sep) << STATE_SEP_SHIFT(flags) | (last_gfx_index) << 7 | (hold_mode) << 6 | ((bg) << 3) | (fg))
+
+#define STATE_FG(s)					((s) & 7)
+#define STATE_BG(s)					(((s) >> 3) & 7)
+#define STATE_HOLD(s)				(((s) >> 6) & 1)
+#define STATE_LAST_GFX_INDEX(s)		(((s) >> 7) & 0x3f)
+#define STATE_SEP(flags,s)			(((s) >> STATE_SEP_SHIFT(flags)) & 1)
+
+// Number of states the solver can reach for these flags
+#define SOLVER_MAX_STATE(flags)	(1U << (STATE_SEP_SHIFT(flags) + (((flags) & SOLVER_SEP) ? 1 : 0)))
+
+#define MAX_CANDIDATES		16
+
+#define DENSE_INDEX(flags,x,state)	((x) * SOLVER_MAX_STATE(flags) + (state))
+#define DENSE_MAX_ERROR				0xffff
+
+#define GFX_INDEX_FROM_CHAR(c)	(((c) & 0x1f) | (((c) & 0x40) >> 1))
+#define GFX_CHAR_FROM_INDEX(i)	((MODE7_BLANK) | ((i) & 0x1f) | (((i) & 0x20) << 1))
+
+#define IMAGE_X_FROM_X7(x7)	(((x7) - FRAME_FIRST_COLUMN) * 2)
+#define IMAGE_Y_FROM_Y7(x7)	((y7) * 3)
+
+#define MIN(A,B)			((A)<(B)?(A):(B))
+#define MAX(A,B)			((A)>(B)?(A):(B))
+#define MAX_3(A,B,C)		((A)>(B)?((A)>(C)?(A):(C)):(B)>(C)?(B):(C))
+#define MIN_3(A,B,C)		((A)<(B)?((A)<(C)?(A):(C)):(B)<(C)?(B):(C))
+
+#define _COLOUR_DEBUG		FALSE
+
+// Everything needed to solve a row - one of these per thread so that rows can be solved in parallel
+
+#define NO_SLOT				0xffff
+
+// Solved rows are kept for reuse - with the context's options a row's pixels are all its solution depends on
+
+#define ROW_CACHE_KEY_SIZE	(MODE7_PIXEL_W * 3 * 3)		// 78 x 3 pixels x RGB
+#define NO_ENTRY			(-1)
+
+// -quant palette lookup
+
+#define QUANT_LUT_BITS		5
+#define QUANT_LUT_SHIFT		(8 - QUANT_LUT_BITS)
+#define QUANT_LUT_SIZE		(1 << (3 * QUANT_LUT_BITS))
+#define QUANT_LUT_INDEX(r,g,b)	((((r) >> QUANT_LUT_SHIFT) << (2 * QUANT_LUT_BITS)) | (((g) >> QUANT_LUT_SHIFT) << QUANT_LUT_BITS) | ((b) >> QUANT_LUT_SHIFT))
+#define QUANT_CLOSEST		0x80		// quant_decision - use the closest palette colour
+#define QUANT_MIXED			0xff		// quant_lut - bin straddles a threshold so decide per pixel
+
+struct row_cache_entry
+{
+	unsigned long long hash;
+	int bucket_next;				// next entry in the same hash bucket
+	int lru_prev;					// more recently used entry
+	int lru_next;					// less recently used entry
+
+	unsigned char key[ROW_CACHE_KEY_SIZE];
+	unsigned char line[MODE7_WIDTH];
+	int start_colour;
+	int error;
+	int exact_error;
+};
+
+// Open list entry for the best-first search - f = error so far (g) + lower bound for the rest of the line
+
+struct best_first_entry
+{
+	int f;
+	int g;
+	int node;
+};
+
+// std heaps put the largest first so "less" means worse: higher f, then less of the line done (lower g), then found later
+
+inline bool operator<(const best_first_entry &a, const best_first_entry &b)
+{
+	if (a.f != b.f) return a.f > b.f;
+	if (a.g != b.g) return a.g < b.g;
+	return a.node > b.node;
+}
+
+struct row_solver
+{
+	// Sparse memo - only the states reachable on the current row, stored column by column in one pool
+	// Each node is a (column, state) pair with its lowest error for the remainder of the line & the char to use
+	// memo_next is the index of the node for the following column that the best char leads to
+
+	int memo_capacity;
+	int memo_size;
+	int column_start[MODE7_WIDTH + 2];
+
+	unsigned short *memo_state;
+	unsigned char *memo_gfx_char;
+	unsigned char *memo_char;
+	int *memo_error;
+	int *memo_next;
+
+	unsigned short slot_for_state[MAX_STATE];
+
+	image2mode7_context *context;
+
+	// Dense memo - only allocated if options.use_dense_memo
+	// Column major so each column's states are together - index with DENSE_INDEX(flags, x, state)
+	// An entry only counts if its generation matches the solver's - every row starts a new generation so nothing is cleared
+	// Errors are kept as 16 bits relative to the lowest error in the column (column_base) divided by memo_scale
+	// A column with any error too big for that also keeps them exact in saturated_error - indexed by state & alternating columns
+
+	unsigned int generation;
+	unsigned int *generation_for_state;
+	unsigned short *total_error_in_state;
+	unsigned char *char_for_xpos_in_state;
+	int column_base[MODE7_WIDTH + 1];
+	bool column_saturated[MODE7_WIDTH + 1];
+	int *saturated_error[2];
+	int memo_scale;
+	int saturated;
+
+	// Best-first & beam search
+	// Nodes are (column, state) pairs in the order they were found, each with the node & char that reached it
+	// best_first_g is the lowest error found so far to reach each [column][state] - INT_MAX if not reached yet
+	// beam is the nodes kept for the current column
+
+	int search_capacity;
+	int search_size;
+
+	unsigned short *search_state;
+	unsigned char *search_x;
+	unsigned char *search_char;
+	int *search_parent;
+	int *search_g;
+
+	int *beam;
+
+	int heap_size;
+	struct best_first_entry *heap;
+
+	int *best_first_g;
+	int lower_bound[MODE7_WIDTH + 1];
+
+	// Error for every cell on the current row
+
+	int row_error_table[MODE7_WIDTH][8][8][2][64];
+	unsigned char row_gfx_char_table[MODE7_WIDTH][8][8][2];
+
+	// Pixels of the current row for looking it up in the row cache
+
+	unsigned char row_cache_key[ROW_CACHE_KEY_SIZE];
+};
+
+struct row_result
+{
+	int start_colour;
+	int error;
+	int states;
+	int expanded;
+	int exact_error;
+	int saturated;
+	int dense_checked;
+	int dense_differs;
+	int cached;
+};
+
+// Everything for one conversion at a time - options, the working image, scratch space for each thread & the results
+// Nothing is shared between contexts so any number of them can be converting at once
+
+struct image2mode7_context
+{
+	image2mode7_options options;
+
+	CImg<unsigned char> src;
+	int frame_width;
+	int frame_height;
+
+	int (*get_pattern_errors)(const int *on_error, const int *off_error, int *errors);
+	int (*get_lowest_total_error)(const int *errors, const int *remaining);
+	void (*sum_weighted_pixels)(const unsigned char *rgb, const unsigned short *weights, int count, unsigned int *sums);
+	const char *kernel_name;
+
+	int solver_flags;
+	void (*solve_row)(row_solver *solver, int y7, row_result *result);
+
+	int num_solvers;
+	row_solver **solvers;
+
+	// Solved rows in least recently used order - shared by the threads & kept between conversions
+
+	std::mutex row_cache_mutex;
+	unsigned long long row_cache_seed;
+	row_cache_entry *row_cache;
+	int row_cache_size;
+	int *row_cache_buckets;
+	int row_cache_num_buckets;
+	int row_cache_head;
+	int row_cache_tail;
+	int row_cache_lookups;
+	int row_cache_hits;
+
+	// Streaming conversion - source rows are area averaged into the pixel grid as they arrive
+	// A source pixel is pixel_width (or height) units across & a grid pixel is width (or height) units so overlaps are whole numbers
+
+	bool stream_active;
+	int stream_width;
+	int stream_height;
+	int stream_row;
+	int stream_pixel_width;
+	int stream_pixel_height;
+	unsigned long long stream_sums[MODE7_PIXEL_H][MODE7_PIXEL_W][3];
+	unsigned long long stream_row_sums[MODE7_PIXEL_W][3];
+
+	// Weights across a row for each grid pixel - the overlap of every source pixel it covers once each for R, G & B
+	// Only worked out again when the source or grid width changes
+
+	int resample_width;
+	int resample_pixel_width;
+	int resample_first[MODE7_PIXEL_W];		// first source byte
+	int resample_count[MODE7_PIXEL_W];		// number of source bytes
+	int resample_offset[MODE7_PIXEL_W];		// into resample_weights
+	unsigned short *resample_weights;
+
+	// -quant palette lookup - only built again when sat, value, black or white change
+	// quant_decision depends on just the value (max) & min of a pixel so is exact for every colour
+	// quant_lut holds the palette colour for each bin of the RGB cube that is the same colour throughout
+
+	bool quant_valid;
+	int quant_sat;
+	int quant_value;
+	int quant_black;
+	int quant_white;
+	int quant_mixed;
+	unsigned char quant_decision[256][256];
+	unsigned char quant_lut[QUANT_LUT_SIZE];
+
+	// Error of each screen colour against an image pixel that is palette colour k - built every frame for cells that
+	// are all palette colours (after -quant or for art already in the eight teletext colours)
+
+	int palette_on_error[8][8][2][8];		// [fg][bg][sep][k]
+	int palette_off_error[8][8];			// [bg][k]
+
+	// -lookup only sees which channels of a pixel are non-zero so every pixel is a palette colour - built every frame
+	// Black outside the image
+
+	unsigned char palette_index[MODE7_MAX_PIXEL_H][MODE7_PIXEL_W];
+
+	// Error of every pixel against every colour the screen can show - index with get_display_index
+	// Built every frame so the metric is only worked out here & the row tables just look it up. Black outside the image
+	// Only the solid colours unless using separated graphics. Not needed for -lookup as all its cells have codes
+
+	int (*display_error)[MODE7_PIXEL_W][64];
+	int display_error_rows;
+
+	unsigned char mode7[IMAGE2MODE7_MAX_PAGE_SIZE];
+	row_result results[MODE7_MAX_HEIGHT];
+	int frame_error;
+	int frame_states;
+	int frame_expanded;
+	int frame_exact_error;
+	int frame_saturated;
+	int frame_dense_checked;
+	int frame_dense_differs;
+	int frame_cached;
+};
+
+static int dither2[4] = {
+	2, 6,
+	8, 4
+};
+
+static int dither23[6] = {
+	2, 8,
+	12, 4,
+	6, 10
+};
+
+static int dither3[9] = {
+	2, 16, 8,
+	14, 12, 6,
+	10, 4, 18
+};
+
+static int dither4[16] = {
+	2, 18, 6, 22,
+	26, 10, 30, 14,
+	8, 24, 4, 20,
+	32, 16, 28, 12
+};
+
+
+// Forget everything in the dense memo - only has to touch the tables once every 2^32 rows when the generation wraps
+
+template<int FLAGS>
+void clear_error_char_arrays(row_solver *solver)
+{
+	if (++solver->generation == 0)
+	{
+		memset(solver->generation_for_state, 0, (MODE7_WIDTH + 1) * SOLVER_MAX_STATE(FLAGS) * sizeof(*solver->generation_for_state));
+		solver->generation = 1;
+	}
+}
+
+template<int FLAGS>
+inline int get_state_for_char(unsigned char proposed_char, int old_state)
+{
+	int fg = STATE_FG(old_state);
+	int bg = STATE_BG(old_state);
+	int hold_mode = STATE_HOLD(old_state);
+	int last_gfx_index = STATE_LAST_GFX_INDEX(old_state);
+	int sep = STATE_SEP(FLAGS, old_state);
+
+	if (FLAGS & SOLVER_FILL)
+	{
+		if (proposed_char == MODE7_NEW_BG)
+		{
+			bg = fg;
+		}
+
+		if (proposed_char == MODE7_BLACK_BG)
+		{
+			bg = 0;
+		}
+	}
+
+	if (proposed_char > MODE7_GFX_COLOUR && proposed_char < MODE7_GFX_COLOUR + 8)
+	{
+		fg = proposed_char - MODE7_GFX_COLOUR;
+	}
+
+	if (FLAGS & SOLVER_HOLD)
+	{
+		if (proposed_char == MODE7_HOLD_GFX)
+		{
+			hold_mode = true;
+		}
+
+		if (proposed_char == MODE7_RELEASE_GFX)
+		{
+			hold_mode = false;
+			last_gfx_index = GFX_INDEX_FROM_CHAR(MODE7_BLANK);
+		}
+
+		if (proposed_char < 128)
+		{
+			last_gfx_index = GFX_INDEX_FROM_CHAR(proposed_char);
+		}
+	}
+	else
+	{
+		// Nothing is ever held so leave the held char out of the state altogether
+		hold_mode = false;
+		last_gfx_index = 0;
+	}
+
+	if (FLAGS & SOLVER_SEP)
+	{
+		if (proposed_char == MODE7_SEP_GFX)
+		{
+			sep = true;
+		}
+
+		if (proposed_char == MODE7_CONTIG_GFX)
+		{
+			sep = false;
+		}
+	}
+
+	return GET_STATE(FLAGS, fg, bg, hold_mode, last_gfx_index, sep);
+}
+
+
+int get_colour_from_rgb(unsigned char r, unsigned char g, unsigned char b)
+{
+	return (r ? 1 : 0) + (g ? 2 : 0) + (b ? 4 : 0);
+}
+
+#define GET_RED_FROM_COLOUR(c)		(c & 1 ? 255:0)
+#define GET_GREEN_FROM_COLOUR(c)	(c & 2 ? 255:0)
+#define GET_BLUE_FROM_COLOUR(c)		(c & 4 ? 255:0)
+
+unsigned char pixel_to_grey(int mode, unsigned char r, unsigned char g, unsigned char b)
+{
+	switch (mode)
+	{
+	case 1:
+		return r;
+
+	case 2:
+		return g;
+
+	case 3:
+		return b;
+
+	case 4:
+		return (unsigned char)((r + g + b) / 3);
+
+	case 5:
+		return (unsigned char)(0.2126f * r + 0.7152f * g + 0.0722f * b);
+
+	default:
+		return 0;
+	}
+}
+
+// For each character cell on this line
+// Do we have pixels or not?
+// If we have pixels then need to decide whether is it better to replace this cell with a control code or use a graphic character
+// If we don't have pixels then need to decide whether it is better to insert a control code or leave empty
+// Possible control codes are: new fg colour, fill (bg colour = fg colour), no fill (bg colour = black), hold graphics (hold char = prev char), release graphics (hold char = empty)
+// "Better" means that the "error" for the rest of the line (appearance on screen vs actual image = deviation) is minimised
+
+// Hold graphics mode means use last known (used on the line) graphic character in place of space when emitting a control code (reset if using alphanumerics not graphics)
+// Palette order = black - red - green - yellow - blue - magenta - cyan - white
+// Brightness order = black - blue - red - magenta - green - cyan - yellow - white
+// Hue order = red - yellow - green - cyan - blue - magenta - red
+
+// Luma values
+// B = 0 ~= 0
+// B = 18 = 18 ~= 1x
+// R = 54 = 18 + 36 ~= 3x
+// M = 73 = 18 + 36 + 19 ~= 4x
+// G = 182 = 18 + 36 + 19 + 109 ~= 10x
+// C = 201 = 18 + 36 + 19 + 109 + 19 ~= 11x
+// Y = 237 = 18 + 36 + 19 + 109 + 19 + 36 ~= 13x
+// W = 255 = 18 + 36 + 19 + 109 + 19 + 36 + 18 ~= 14x
+
+static int error_colour_vs_colour[8][8] = {
+
+#if 0		// This maps error to luma when comparing colours against black/white
+	{ 0, 3, 10, 13, 1, 4, 11, 14 },		// black
+	{ 3, 0, 8, 4, 8, 4, 12, 11 },		// red
+	{ 10, 8, 0, 4, 8, 12, 4, 4 },		// green
+	{ 13, 4, 4, 0, 12, 8, 8, 1 },		// yellow
+	{ 1, 8, 8, 12, 0, 4, 4, 13 },		// blue
+	{ 4, 4, 12, 8, 4, 0, 8, 10 },		// magenta
+	{ 11, 12, 4, 8, 4, 8, 0, 3 },		// cyan
+	{ 14, 11, 4, 1, 13, 10, 3, 0 },		// white
+#else		// This maps colours in brightness order when comparing against black/white
+	{ 0, 2, 4, 6, 1, 3, 5, 7 },		// black
+	{ 2, 0, 4, 2, 4, 2, 6, 5 },		// red
+	{ 4, 4, 0, 2, 4, 6, 2, 3 },		// green
+	{ 6, 2, 2, 0, 6, 4, 4, 1 },		// yellow
+	{ 1, 4, 4, 6, 0, 2, 2, 6 },		// blue
+	{ 3, 2, 6, 4, 2, 0, 4, 4 },		// magenta
+	{ 5, 6, 2, 4, 2, 4, 0, 2 },		// cyan
+	{ 7, 5, 3, 1, 6, 4, 2, 0 },		// white
+#endif
+};
+
+template<bool GEOMETRIC>
+inline int error_function(int screen_r, int screen_g, int screen_b, int image_r, int image_g, int image_b)
+{
+	if (GEOMETRIC)
+	{
+		return (((screen_r - image_r) * (screen_r - image_r)) + ((screen_g - image_g) * (screen_g - image_g)) + ((screen_b - image_b) * (screen_b - image_b))); // / (255 * 255);
+	}
+	else
+	{
+		// Use lookup
+		return error_colour_vs_colour[get_colour_from_rgb(screen_r, screen_g, screen_b)][get_colour_from_rgb(image_r, image_g, image_b)];
+	}
+}
+
+// These are the pixels that will get written to the screen
+
+inline void get_screen_colour(const image2mode7_context *context, int screen_bit, int fg, int bg, bool sep, int *screen_r, int *screen_g, int *screen_b)
+{
+	if (screen_bit)
+	{
+		if (sep)
+		{ 
+			*screen_r = (context->options.sep_fg_factor * GET_RED_FROM_COLOUR(fg) + (255 - context->options.sep_fg_factor) * GET_RED_FROM_COLOUR(bg)) / 255;
+			*screen_g = (context->options.sep_fg_factor * GET_GREEN_FROM_COLOUR(fg) + (255 - context->options.sep_fg_factor) * GET_GREEN_FROM_COLOUR(bg)) / 255;
+			*screen_b = (context->options.sep_fg_factor * GET_BLUE_FROM_COLOUR(fg) + (255 - context->options.sep_fg_factor) * GET_BLUE_FROM_COLOUR(bg)) / 255;
+		}
+		else
+		{
+			*screen_r = GET_RED_FROM_COLOUR(fg);
+			*screen_g = GET_GREEN_FROM_COLOUR(fg);
+			*screen_b = GET_BLUE_FROM_COLOUR(fg);
+		}
+	}
+	else
+	{
+		*screen_r = GET_RED_FROM_COLOUR(bg);
+		*screen_g = GET_GREEN_FROM_COLOUR(bg);
+		*screen_b = GET_BLUE_FROM_COLOUR(bg);
+	}
+}
+
+template<bool GEOMETRIC>
+inline int get_error_for_screen_colour(const image2mode7_context *context, int image_r, int image_g, int image_b, int screen_bit, int fg, int bg, bool sep)
+{
+	int screen_r, screen_g, screen_b;
+
+	get_screen_colour(context, screen_bit, fg, bg, sep, &screen_r, &screen_g, &screen_b);
+
+	// Calculate the error between them
+
+	return error_function<GEOMETRIC>(screen_r, screen_g, screen_b, image_r, image_g, image_b);
+}
+
+// Screen colours are a separated pixel's blend of fg & bg (fg * 8 + bg) - solid colour c is the blend of c with itself
+
+inline int get_display_index(int screen_bit, int fg, int bg, bool sep)
+{
+	if (!screen_bit) return bg * 9;
+
+	return sep ? fg * 8 + bg : fg * 9;
+}
+
+template<bool GEOMETRIC>
+void build_display_error_cache(image2mode7_context *context)
+{
+	int width = MIN((int)IMAGE_W, MODE7_PIXEL_W);
+	int height = MIN((int)IMAGE_H, FRAME_HEIGHT * 3);
+
+	if (context->display_error_rows < FRAME_HEIGHT * 3)
+	{
+		context->display_error_rows = FRAME_HEIGHT * 3;
+		context->display_error = (int (*)[MODE7_PIXEL_W][64])realloc(context->display_error, context->display_error_rows * sizeof(*context->display_error));
+	}
+
+	// The colours themselves are the same for every pixel
+
+	int num_colours = 0;
+	int colour_index[64];
+	int colour_rgb[64][3];
+
+	for (int fg = 0; fg < 8; fg++)
+	{
+		for (int bg = 0; bg < 8; bg++)
+		{
+			if (fg == bg || context->options.use_sep)
+			{
+				colour_index[num_colours] = fg * 8 + bg;
+				get_screen_colour(context, 1, fg, bg, fg != bg, &colour_rgb[num_colours][0], &colour_rgb[num_colours][1], &colour_rgb[num_colours][2]);
+				num_colours++;
+			}
+		}
+	}
+
+	for (int y = 0; y < FRAME_HEIGHT * 3; y++)
+	{
+		for (int x = 0; x < MODE7_PIXEL_W; x++)
+		{
+			bool inside = x < width && y < height;
+
+			int image_r = inside ? context->src(x, y, 0) : 0;
+			int image_g = inside ? context->src(x, y, 1) : 0;
+			int image_b = inside ? context->src(x, y, 2) : 0;
+
+			for (int i = 0; i < num_colours; i++)
+			{
+				context->display_error[y][x][colour_index[i]] = error_function<GEOMETRIC>(colour_rgb[i][0], colour_rgb[i][1], colour_rgb[i][2], image_r, image_g, image_b);
+			}
+		}
+	}
+}
+
+inline int get_error_for_screen_pixel(const image2mode7_context *context, int x, int y, int screen_bit, int fg, int bg, bool sep)
+{
+	return context->display_error[y][x][get_display_index(screen_bit, fg, bg, sep)];
+}
+
+template<bool GEOMETRIC>
+void build_palette_error_tables(image2mode7_context *context)
+{
+	for (int k = 0; k < 8; k++)
+	{
+		int image_r = GET_RED_FROM_COLOUR(k);
+		int image_g = GET_GREEN_FROM_COLOUR(k);
+		int image_b = GET_BLUE_FROM_COLOUR(k);
+
+		for (int bg = 0; bg < 8; bg++)
+		{
+			context->palette_off_error[bg][k] = get_error_for_screen_colour<GEOMETRIC>(context, image_r, image_g, image_b, 0, 0, bg, false);
+
+			for (int fg = 0; fg < 8; fg++)
+			{
+				for (int sep = 0; sep < 2; sep++)
+				{
+					context->palette_on_error[fg][bg][sep][k] = get_error_for_screen_colour<GEOMETRIC>(context, image_r, image_g, image_b, 1, fg, bg, sep);
+				}
+			}
+		}
+	}
+}
+
+void build_palette_index_plane(image2mode7_context *context)
+{
+	memset(context->palette_index, 0, sizeof(context->palette_index));
+
+	int width = MIN((int)IMAGE_W, MODE7_PIXEL_W);
+	int height = MIN((int)IMAGE_H, FRAME_HEIGHT * 3);
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			context->palette_index[y][x] = get_colour_from_rgb(context->src(x, y, 0), context->src(x, y, 1), context->src(x, y, 2));
+		}
+	}
+}
+
+// 18-bit code of a cell - the palette colour of each of its six pixels in sixel bit order, or -1 if any pixel isn't one
+// Black outside the image
+
+inline int get_cell_code(const image2mode7_context *context, const int *pixel_x, const int *pixel_y)
+{
+	int code = 0;
+
+	for (int p = 0; p < 6; p++)
+	{
+		if (pixel_x[p] >= (int)IMAGE_W || pixel_y[p] >= (int)IMAGE_H)
+			continue;
+
+		int r = context->src(pixel_x[p], pixel_y[p], 0);
+		int g = context->src(pixel_x[p], pixel_y[p], 1);
+		int b = context->src(pixel_x[p], pixel_y[p], 2);
+
+		if ((r != 0 && r != 255) || (g != 0 && g != 255) || (b != 0 && b != 255))
+			return -1;
+
+		code |= get_colour_from_rgb(r, g, b) << (3 * p);
+	}
+
+	return code;
+}
+
+inline int get_lookup_cell_code(const image2mode7_context *context, const int *pixel_x, const int *pixel_y)
+{
+	int code = 0;
+
+	for (int p = 0; p < 6; p++)
+	{
+		code |= context->palette_index[pixel_y[p]][pixel_x[p]] << (3 * p);
+	}
+
+	return code;
+}
+
+//
+// Pattern error kernels
+//
+// get_pattern_errors: fill in the error for all 64 pixel patterns of a cell from the error of each of its six pixels
+// being on or off and return the pattern with the lowest error (first one wins).
+// get_lowest_total_error: return the first pattern with the lowest errors[i] + remaining[i].
+// sum_weighted_pixels: sums[c] = total of rgb[i] * weights[i] over count bytes of interleaved RGB where i % 3 == c -
+// one grid pixel's share of a source row when area averaging (weights are at most 78 so products fit in 16 bits).
+// The SSE4.1 & AVX2 versions do 4 or 8 patterns at a time and are picked at run time if the CPU has them.
+//
+
+#define PATTERN_EXCLUDED	(INT_MAX / 2)
+
+int get_pattern_errors_scalar(const int *on_error, const int *off_error, int *errors)
+{
+	int lowest = 0;
+
+	// Start with every pixel off then each pattern differs from a smaller one by its lowest set pixel
+
+	errors[0] = 0;
+
+	for (int p = 0; p < 6; p++)
+	{
+		errors[0] += off_error[p];
+	}
+
+	for (int i = 1; i < 64; i++)
+	{
+		int p = 0;
+		while (!(i & (1 << p))) p++;
+
+		errors[i] = errors[i & (i - 1)] + on_error[p] - off_error[p];
+
+		if (errors[i] < errors[lowest]) lowest = i;
+	}
+
+	return lowest;
+}
+
+void sum_weighted_pixels_scalar(const unsigned char *rgb, const unsigned short *weights, int count, unsigned int *sums)
+{
+	sums[0] = sums[1] = sums[2] = 0;
+
+	for (int i = 0; i < count; i += 3)
+	{
+		sums[0] += rgb[i + 0] * weights[i + 0];
+		sums[1] += rgb[i + 1] * weights[i + 1];
+		sums[2] += rgb[i + 2] * weights[i + 2];
+	}
+}
+
+int get_lowest_total_error_scalar(const int *errors, const int *remaining)
+{
+	int lowest = 0;
+	int lowest_error = errors[0] + remaining[0];
+
+	for (int i = 1; i < 64; i++)
+	{
+		if (errors[i] + remaining[i] < lowest_error)
+		{
+			lowest_error = errors[i] + remaining[i];
+			lowest = i;
+		}
+	}
+
+	return lowest;
+}
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define USE_SIMD_KERNELS
+
+#if defined(_MSC_VER)
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41		__attribute__((target("sse4.1")))
+#define TARGET_AVX2			__attribute__((target("avx2")))
+#endif
+
+// Lanes hold the lowest error seen so far for patterns lane, lane + width, lane + 2 * width...
+// so the lowest error overall is the lowest lane and a tie between lanes goes to the smallest pattern
+
+static int get_lowest_lane(const int *lane_error, const int *lane_index, int width)
+{
+	int lowest = 0;
+
+	for (int lane = 1; lane < width; lane++)
+	{
+		if (lane_error[lane] < lane_error[lowest] || (lane_error[lane] == lane_error[lowest] && lane_index[lane] < lane_index[lowest]))
+		{
+			lowest = lane;
+		}
+	}
+
+	return lane_index[lowest];
+}
+
+TARGET_SSE41 int get_pattern_errors_sse41(const int *on_error, const int *off_error, int *errors)
+{
+	int off_sum = 0;
+
+	for (int p = 0; p < 6; p++)
+	{
+		off_sum += off_error[p];
+	}
+
+	__m128i index = _mm_setr_epi32(0, 1, 2, 3);
+	__m128i lowest_error = _mm_set1_epi32(INT_MAX);
+	__m128i lowest_index = _mm_setzero_si128();
+
+	for (int i = 0; i < 64; i += 4)
+	{
+		__m128i error = _mm_set1_epi32(off_sum);
+
+		for (int p = 0; p < 6; p++)
+		{
+			__m128i bit = _mm_set1_epi32(1 << p);
+			__m128i on = _mm_cmpeq_epi32(_mm_and_si128(index, bit), bit);
+
+			error = _mm_add_epi32(error, _mm_and_si128(on, _mm_set1_epi32(on_error[p] - off_error[p])));
+		}
+
+		_mm_storeu_si128((__m128i *)&errors[i], error);
+
+		__m128i lower = _mm_cmplt_epi32(error, lowest_error);
+		lowest_error = _mm_blendv_epi8(lowest_error, error, lower);
+		lowest_index = _mm_blendv_epi8(lowest_index, index, lower);
+
+		index = _mm_add_epi32(index, _mm_set1_epi32(4));
+	}
+
+	int lane_error[4], lane_index[4];
+	_mm_storeu_si128((__m128i *)lane_error, lowest_error);
+	_mm_storeu_si128((__m128i *)lane_index, lowest_index);
+
+	return get_lowest_lane(lane_error, lane_index, 4);
+}
+
+TARGET_SSE41 int get_lowest_total_error_sse41(const int *errors, const int *remaining)
+{
+	__m128i index = _mm_setr_epi32(0, 1, 2, 3);
+	__m128i lowest_error = _mm_set1_epi32(INT_MAX);
+	__m128i lowest_index = _mm_setzero_si128();
+
+	for (int i = 0; i < 64; i += 4)
+	{
+		__m128i error = _mm_add_epi32(_mm_loadu_si128((const __m128i *)&errors[i]), _mm_loadu_si128((const __m128i *)&remaining[i]));
+
+		__m128i lower = _mm_cmplt_epi32(error, lowest_error);
+		lowest_error = _mm_blendv_epi8(lowest_error, error, lower);
+		lowest_index = _mm_blendv_epi8(lowest_index, index, lower);
+
+		index = _mm_add_epi32(index, _mm_set1_epi32(4));
+	}
+
+	int lane_error[4], lane_index[4];
+	_mm_storeu_si128((__m128i *)lane_error, lowest_error);
+	_mm_storeu_si128((__m128i *)lane_index, lowest_index);
+
+	return get_lowest_lane(lane_error, lane_index, 4);
+}
+
+// 24 bytes (8 pixels) at a time so that each 32-bit lane of the six accumulators always holds the same channel
+
+TARGET_SSE41 void sum_weighted_pixels_sse41(const unsigned char *rgb, const unsigned short *weights, int count, unsigned int *sums)
+{
+	__m128i sum[6];
+
+	for (int k = 0; k < 6; k++)
+	{
+		sum[k] = _mm_setzero_si128();
+	}
+
+	int i = 0;
+
+	for (; i + 24 <= count; i += 24)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i *)&rgb[i]);
+
+		__m128i product0 = _mm_mullo_epi16(_mm_cvtepu8_epi16(bytes), _mm_loadu_si128((const __m128i *)&weights[i]));
+		__m128i product1 = _mm_mullo_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(bytes, 8)), _mm_loadu_si128((const __m128i *)&weights[i + 8]));
+		__m128i product2 = _mm_mullo_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)&rgb[i + 16])), _mm_loadu_si128((const __m128i *)&weights[i + 16]));
+
+		sum[0] = _mm_add_epi32(sum[0], _mm_cvtepu16_epi32(product0));
+		sum[1] = _mm_add_epi32(sum[1], _mm_cvtepu16_epi32(_mm_srli_si128(product0, 8)));
+		sum[2] = _mm_add_epi32(sum[2], _mm_cvtepu16_epi32(product1));
+		sum[3] = _mm_add_epi32(sum[3], _mm_cvtepu16_epi32(_mm_srli_si128(product1, 8)));
+		sum[4] = _mm_add_epi32(sum[4], _mm_cvtepu16_epi32(product2));
+		sum[5] = _mm_add_epi32(sum[5], _mm_cvtepu16_epi32(_mm_srli_si128(product2, 8)));
+	}
+
+	unsigned int lanes[24];
+
+	for (int k = 0; k < 6; k++)
+	{
+		_mm_storeu_si128((__m128i *)&lanes[k * 4], sum[k]);
+	}
+
+	sums[0] = sums[1] = sums[2] = 0;
+
+	for (int j = 0; j < 24; j++)
+	{
+		sums[j % 3] += lanes[j];
+	}
+
+	for (; i < count; i++)
+	{
+		sums[i % 3] += rgb[i] * weights[i];
+	}
+}
+
+TARGET_AVX2 int get_pattern_errors_avx2(const int *on_error, const int *off_error, int *errors)
+{
+	int off_sum = 0;
+
+	for (int p = 0; p < 6; p++)
+	{
+		off_sum += off_error[p];
+	}
+
+	__m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i lowest_error = _mm256_set1_epi32(INT_MAX);
+	__m256i lowest_index = _mm256_setzero_si256();
+
+	for (int i = 0; i < 64; i += 8)
+	{
+		__m256i error = _mm256_set1_epi32(off_sum);
+
+		for (int p = 0; p < 6; p++)
+		{
+			__m256i bit = _mm256_set1_epi32(1 << p);
+			__m256i on = _mm256_cmpeq_epi32(_mm256_and_si256(index, bit), bit);
+
+			error = _mm256_add_epi32(error, _mm256_and_si256(on, _mm256_set1_epi32(on_error[p] - off_error[p])));
+		}
+
+		_mm256_storeu_si256((__m256i *)&errors[i], error);
+
+		__m256i lower = _mm256_cmpgt_epi32(lowest_error, error);
+		lowest_error = _mm256_blendv_epi8(lowest_error, error, lower);
+		lowest_index = _mm256_blendv_epi8(lowest_index, index, lower);
+
+		index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+	}
+
+	int lane_error[8], lane_index[8];
+	_mm256_storeu_si256((__m256i *)lane_error, lowest_error);
+	_mm256_storeu_si256((__m256i *)lane_index, lowest_index);
+
+	return get_lowest_lane(lane_error, lane_index, 8);
+}
+
+TARGET_AVX2 int get_lowest_total_error_avx2(const int *errors, const int *remaining)
+{
+	__m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i lowest_error = _mm256_set1_epi32(INT_MAX);
+	__m256i lowest_index = _mm256_setzero_si256();
+
+	for (int i = 0; i < 64; i += 8)
+	{
+		__m256i error = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)&errors[i]), _mm256_loadu_si256((const __m256i *)&remaining[i]));
+
+		__m256i lower = _mm256_cmpgt_epi32(lowest_error, error);
+		lowest_error = _mm256_blendv_epi8(lowest_error, error, lower);
+		lowest_index = _mm256_blendv_epi8(lowest_index, index, lower);
+
+		index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+	}
+
+	int lane_error[8], lane_index[8];
+	_mm256_storeu_si256((__m256i *)lane_error, lowest_error);
+	_mm256_storeu_si256((__m256i *)lane_index, lowest_index);
+
+	return get_lowest_lane(lane_error, lane_index, 8);
+}
+
+static bool cpu_has_sse41(void)
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 19)) != 0;
+#else
+	return __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+static bool cpu_has_avx2(void)
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+
+	// Need the OS to save the AVX registers as well as the CPU supporting it
+	if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+void select_pattern_error_kernels(image2mode7_context *context, bool use_simd)
+{
+#ifdef USE_SIMD_KERNELS
+	if (use_simd && cpu_has_avx2())
+	{
+		context->get_pattern_errors = get_pattern_errors_avx2;
+		context->get_lowest_total_error = get_lowest_total_error_avx2;
+		context->sum_weighted_pixels = sum_weighted_pixels_sse41;
+		context->kernel_name = "AVX2";
+		return;
+	}
+
+	if (use_simd && cpu_has_sse41())
+	{
+		context->get_pattern_errors = get_pattern_errors_sse41;
+		context->get_lowest_total_error = get_lowest_total_error_sse41;
+		context->sum_weighted_pixels = sum_weighted_pixels_sse41;
+		context->kernel_name = "SSE4.1";
+		return;
+	}
+#endif
+
+	context->get_pattern_errors = get_pattern_errors_scalar;
+	context->get_lowest_total_error = get_lowest_total_error_scalar;
+	context->sum_weighted_pixels = sum_weighted_pixels_scalar;
+	context->kernel_name = "scalar";
+}
+
+// Per-row table of the error for every cell, colour combination and pixel pattern - built once per row before solving
+// so that the DP only ever has to look errors up rather than going back to the image
+// Cells that are all palette colours (every cell with -lookup) take pixel errors from the palette tables & ones with the
+// same code as a cell earlier in the row just copy its table
+
+template<int FLAGS>
+void build_error_table_for_row(row_solver *solver, int y7)
+{
+	const bool GEOMETRIC = (FLAGS & SOLVER_GEOMETRIC) != 0;
+
+	image2mode7_context *context = solver->context;
+
+	int y = IMAGE_Y_FROM_Y7(y7);
+
+	int cell_code[MODE7_WIDTH];
+
+	for (int x7 = FRAME_FIRST_COLUMN; x7 < MODE7_WIDTH; x7++)
+	{
+		int x = IMAGE_X_FROM_X7(x7);
+
+		// The six pixels in the character cell in sixel bit order
+
+		int pixel_x[6] = { x, x + 1, x, x + 1, x, x + 1 };
+		int pixel_y[6] = { y, y, y + 1, y + 1, y + 2, y + 2 };
+
+		int code = GEOMETRIC ? get_cell_code(context, pixel_x, pixel_y) : get_lookup_cell_code(context, pixel_x, pixel_y);
+
+		cell_code[x7] = code;
+
+		if (code >= 0)
+		{
+			int same_x7 = FRAME_FIRST_COLUMN;
+			while (cell_code[same_x7] != code) same_x7++;
+
+			if (same_x7 < x7)
+			{
+				memcpy(solver->row_error_table[x7], solver->row_error_table[same_x7], sizeof(solver->row_error_table[x7]));
+				memcpy(solver->row_gfx_char_table[x7], solver->row_gfx_char_table[same_x7], sizeof(solver->row_gfx_char_table[x7]));
+				continue;
+			}
+		}
+
+		int colour[6];
+
+		for (int p = 0; p < 6; p++)
+		{
+			colour[p] = (code >> (3 * p)) & 7;
+		}
+
+		// Error for each pixel being off only depends on the bg colour
+
+		int off_error[8][6];
+
+		for (int bg = 0; bg < 8; bg++)
+		{
+			for (int p = 0; p < 6; p++)
+			{
+				off_error[bg][p] = code >= 0 ? context->palette_off_error[bg][colour[p]] : get_error_for_screen_pixel(context, pixel_x[p], pixel_y[p], 0, 0, bg, false);
+			}
+		}
+
+		for (int sep = 0; sep <= ((FLAGS & SOLVER_SEP) ? 1 : 0); sep++)
+		{
+			for (int fg = 0; fg < 8; fg++)
+			{
+				for (int bg = 0; bg < 8; bg++)
+				{
+					int on_error[6];
+
+					for (int p = 0; p < 6; p++)
+					{
+						on_error[p] = code >= 0 ? context->palette_on_error[fg][bg][sep][colour[p]] : get_error_for_screen_pixel(context, pixel_x[p], pixel_y[p], 1, fg, bg, sep);
+					}
+
+					// Best graphic char is just the pattern with the lowest error
+					int gfx_index = context->get_pattern_errors(on_error, off_error[bg], solver->row_error_table[x7][fg][bg][sep]);
+
+					solver->row_gfx_char_table[x7][fg][bg][sep] = GFX_CHAR_FROM_INDEX(gfx_index);
+				}
+			}
+		}
+	}
+}
+
+inline int get_error_for_screen_index(row_solver *solver, int x7, int screen_index, int fg, int bg, bool sep)
+{
+	// For all six pixels in the character cell
+
+	return solver->row_error_table[x7][fg][bg][sep][screen_index];
+}
+
+// Functions - get_error_for_char(int x7, unsigned char code, int fg, int bg, int hold_index)
+template<int FLAGS>
+inline int get_error_for_char(row_solver *solver, int x7, unsigned char proposed_char, int fg, int bg, bool hold_mode, int last_gfx_index, bool sep)
+{
+	// If proposed character >= 128 then this is a control code
+	// If so then the hold char will be displayed on screen
+	// Otherwise it will be our proposed character (pixels)
+
+	int screen_index;
+
+	if (proposed_char < 128)
+	{
+		screen_index = GFX_INDEX_FROM_CHAR(proposed_char);
+	}
+	else if ((FLAGS & SOLVER_HOLD) && hold_mode)
+	{
+		screen_index = last_gfx_index;
+	}
+	else
+	{
+		screen_index = GFX_INDEX_FROM_CHAR(MODE7_BLANK);
+	}
+
+	return get_error_for_screen_index(solver, x7, screen_index, fg, bg, sep);
+}
+
+unsigned char get_graphic_char_from_image(row_solver *solver, int x7, int fg, int bg, bool sep)
+{
+	// Try every possible combination of pixels to get lowest error - already done when the row table was built
+
+	return solver->row_gfx_char_table[x7][fg][bg][sep];
+}
+
+// Candidate characters for a cell in a given state, in the order they are tried (first lowest error wins):
+// Stay blank
+// Fill (if bg != fg)
+// No fill (if bg != 0)
+// Separated graphics (if !sep) or contiguous graphics (if sep)
+// Hold graphics (if hold_mode == false) or release graphics (if hold_mode == true)
+// Set graphic colour (colour != fg) x6
+// Graphic char (if set) or every possible graphic char (if SOLVER_TRY_ALL - not included in the list)
+
+template<int FLAGS>
+inline int get_candidate_chars_for_state(int state, unsigned char graphic_char, unsigned char *candidates)
+{
+	int fg = STATE_FG(state);
+	int bg = STATE_BG(state);
+	int hold_mode = STATE_HOLD(state);
+	int sep = STATE_SEP(FLAGS, state);
+
+	int num_candidates = 0;
+
+	// Always try a blank first
+	candidates[num_candidates++] = MODE7_BLANK;
+
+	// If the background is black we could enable fill! - you idiot - can enable fill at any time if fg colour has changed since last time!
+	if (FLAGS & SOLVER_FILL)
+	{
+		if (bg != fg) candidates[num_candidates++] = MODE7_NEW_BG;
+
+		// If the background is not black we could disable fill!
+		if (bg != 0) candidates[num_candidates++] = MODE7_BLACK_BG;
+	}
+
+	// We could enter seperated graphics mode or go back to contiguous graphics...
+	if (FLAGS & SOLVER_SEP)
+	{
+		candidates[num_candidates++] = sep ? MODE7_CONTIG_GFX : MODE7_SEP_GFX;
+	}
+
+	// We could enter or exit hold graphics mode!
+	if (FLAGS & SOLVER_HOLD)
+	{
+		candidates[num_candidates++] = hold_mode ? MODE7_RELEASE_GFX : MODE7_HOLD_GFX;
+	}
+
+	// We could change our fg colour!
+	for (int c = 1; c < 8; c++)
+	{
+		if (c != fg) candidates[num_candidates++] = MODE7_GFX_COLOUR + c;
+	}
+
+	if (!(FLAGS & SOLVER_TRY_ALL))
+	{
+		// Try our graphic character (if it's not blank)
+		if (graphic_char != MODE7_BLANK) candidates[num_candidates++] = graphic_char;
+	}
+
+	// Otherwise every possible graphic character is tried separately - see get_state_for_graphic_char()
+
+	return num_candidates;
+}
+
+// With hold the graphic char becomes the held char, otherwise they all lead to the same state as a blank
+
+template<int FLAGS>
+inline int get_state_for_graphic_char(int state_for_blank, int gfx_index)
+{
+	return (FLAGS & SOLVER_HOLD) ? (state_for_blank & ~(0x3f << 7)) | (gfx_index << 7) : state_for_blank;
+}
+
+void clear_slot_for_state(row_solver *solver)
+{
+	for (int state = 0; state < (int)MAX_STATE; state++)
+	{
+		solver->slot_for_state[state] = NO_SLOT;
+	}
+}
+
+int add_memo_node(row_solver *solver, int state)
+{
+	if (solver->memo_size == solver->memo_capacity)
+	{
+		solver->memo_capacity = solver->memo_capacity ? solver->memo_capacity * 2 : 65536;
+
+		solver->memo_state = (unsigned short *)realloc(solver->memo_state, solver->memo_capacity * sizeof(unsigned short));
+		solver->memo_gfx_char = (unsigned char *)realloc(solver->memo_gfx_char, solver->memo_capacity * sizeof(unsigned char));
+		solver->memo_char = (unsigned char *)realloc(solver->memo_char, solver->memo_capacity * sizeof(unsigned char));
+		solver->memo_error = (int *)realloc(solver->memo_error, solver->memo_capacity * sizeof(int));
+		solver->memo_next = (int *)realloc(solver->memo_next, solver->memo_capacity * sizeof(int));
+	}
+
+	solver->memo_state[solver->memo_size] = state;
+	solver->memo_error[solver->memo_size] = 0;					// nothing to the right of the last column so its error is zero, all others get filled in later
+	solver->memo_next[solver->memo_size] = -1;
+
+	return solver->memo_size++;
+}
+
+// Add a node for this state in column x if it hasn't been reached already
+
+template<int FLAGS>
+inline void add_reachable_state(row_solver *solver, int x, int state)
+{
+	if (FLAGS & SOLVER_DENSE)
+	{
+		if (solver->generation_for_state[DENSE_INDEX(FLAGS, x, state)] != solver->generation)
+		{
+			solver->generation_for_state[DENSE_INDEX(FLAGS, x, state)] = solver->generation;
+			solver->total_error_in_state[DENSE_INDEX(FLAGS, x, state)] = 0;
+			add_memo_node(solver, state);
+		}
+	}
+	else if (solver->slot_for_state[state] == NO_SLOT)
+	{
+		solver->slot_for_state[state] = solver->memo_size - solver->column_start[x];
+		add_memo_node(solver, state);
+	}
+}
+
+// Point solver->slot_for_state at the nodes for column x so we can look them up by state - and reset it afterwards
+
+void set_slots_for_column(row_solver *solver, int x)
+{
+	for (int node = solver->column_start[x]; node < solver->column_start[x + 1]; node++)
+	{
+		solver->slot_for_state[solver->memo_state[node]] = node - solver->column_start[x];
+	}
+}
+
+void reset_slots_for_column(row_solver *solver, int x)
+{
+	for (int node = solver->column_start[x]; node < solver->column_start[x + 1]; node++)
+	{
+		solver->slot_for_state[solver->memo_state[node]] = NO_SLOT;
+	}
+}
+
+// Solve the rest of the line from column x7 onwards starting in the given state
+// Rather than recursing we first sweep left to right to find the frontier of states reachable in each column,
+// then work right to left so that the error for every state in the next column is known before it is needed.
+// By default results are kept in the sparse memo - only the states actually reached on this row are touched.
+// With SOLVER_DENSE they are left in solver->total_error_in_state & solver->char_for_xpos_in_state instead.
+// Either way use get_chars_for_remainder_of_line() to backtrack through them.
+
+template<int FLAGS>
+int get_error_for_remainder_of_line(row_solver *solver, int x7, int start_state)
+{
+	image2mode7_context *context = solver->context;
+
+	unsigned char candidates[MAX_CANDIDATES];
+
+	solver->memo_size = 0;
+	solver->column_start[x7] = 0;
+	add_memo_node(solver, start_state);
+
+	// Forward sweep: find every state that can be reached in the next column
+
+	for (int x = x7; x < MODE7_WIDTH; x++)
+	{
+		solver->column_start[x + 1] = solver->memo_size;
+
+		for (int node = solver->column_start[x]; node < solver->column_start[x + 1]; node++)
+		{
+			int state = solver->memo_state[node];
+
+			// Only need to look at the image once per state - remember the graphic char for the backward sweep
+			unsigned char graphic_char = (FLAGS & SOLVER_TRY_ALL) ? MODE7_BLANK : get_graphic_char_from_image(solver, x, STATE_FG(state), STATE_BG(state), STATE_SEP(FLAGS, state));
+			solver->memo_gfx_char[node] = graphic_char;
+
+			int num_candidates = get_candidate_chars_for_state<FLAGS>(state, graphic_char, candidates);
+
+			for (int c = 0; c < num_candidates; c++)
+			{
+				add_reachable_state<FLAGS>(solver, x + 1, get_state_for_char<FLAGS>(candidates[c], state));
+			}
+
+			if ((FLAGS & SOLVER_TRY_ALL))
+			{
+				int newstate_for_blank = get_state_for_char<FLAGS>(MODE7_BLANK, state);
+
+				for (int i = 1; i < 64; i++)
+				{
+					add_reachable_state<FLAGS>(solver, x + 1, get_state_for_graphic_char<FLAGS>(newstate_for_blank, i));
+				}
+			}
+		}
+
+		solver->column_start[x + 2] = solver->memo_size;
+
+		if (!(FLAGS & SOLVER_DENSE))
+		{
+			reset_slots_for_column(solver, x + 1);
+		}
+	}
+
+	// Backward sweep: lowest error for the remainder of the line from every reachable state
+
+	int scale = solver->memo_scale;
+
+	solver->column_base[MODE7_WIDTH] = 0;
+	solver->column_saturated[MODE7_WIDTH] = false;
+	solver->saturated = 0;
+
+	for (int x = MODE7_WIDTH - 1; x >= x7; x--)
+	{
+		if (!(FLAGS & SOLVER_DENSE))
+		{
+			set_slots_for_column(solver, x + 1);
+		}
+
+		// Dense errors for the next column are relative to its lowest error - which is the same for every candidate so add it on after
+		// Unless it saturated, then its exact errors are read instead
+		const unsigned short *next_error = (FLAGS & SOLVER_DENSE) ? &solver->total_error_in_state[DENSE_INDEX(FLAGS, x + 1, 0)] : NULL;
+		const int *next_exact = (FLAGS & SOLVER_DENSE) && solver->column_saturated[x + 1] ? solver->saturated_error[(x + 1) & 1] : NULL;
+		int next_base = next_exact ? 0 : solver->column_base[x + 1];
+
+		for (int node = solver->column_start[x]; node < solver->column_start[x + 1]; node++)
+		{
+			int state = solver->memo_state[node];
+			int fg = STATE_FG(state);
+			int num_candidates = get_candidate_chars_for_state<FLAGS>(state, solver->memo_gfx_char[node], candidates);
+
+			int lowest_error = INT_MAX;
+			unsigned char lowest_char = 'Z';
+			int lowest_next = -1;
+
+			for (int c = 0; c < num_candidates; c++)
+			{
+				int newstate = get_state_for_char<FLAGS>(candidates[c], state);
+
+				// The new bg, hold & sep modes take effect immediately in this cell but the fg colour doesn't change until the next cell
+				int error = get_error_for_char<FLAGS>(solver, x, candidates[c], fg, STATE_BG(newstate), STATE_HOLD(newstate), STATE_LAST_GFX_INDEX(newstate), STATE_SEP(FLAGS, newstate));
+				int next = -1;
+
+				if ((FLAGS & SOLVER_DENSE))
+				{
+					error += next_exact ? next_exact[newstate] : next_error[newstate] * scale;
+				}
+				else
+				{
+					next = solver->column_start[x + 1] + solver->slot_for_state[newstate];
+					error += solver->memo_error[next];
+				}
+
+				if (error < lowest_error)
+				{
+					lowest_error = error;
+					lowest_char = candidates[c];
+					lowest_next = next;
+				}
+			}
+
+			if ((FLAGS & SOLVER_TRY_ALL))
+			{
+				// Graphic chars only differ in the error for the cell and (with hold) the char held for the next cell
+				int remaining[64];
+				int next_for_pattern[64];
+
+				remaining[0] = PATTERN_EXCLUDED;				// blank was tried first
+				next_for_pattern[0] = -1;
+
+				int newstate_for_blank = get_state_for_char<FLAGS>(MODE7_BLANK, state);
+
+				for (int i = 1; i < 64; i++)
+				{
+					int newstate = get_state_for_graphic_char<FLAGS>(newstate_for_blank, i);
+
+					if ((FLAGS & SOLVER_DENSE))
+					{
+						remaining[i] = next_exact ? next_exact[newstate] : next_error[newstate] * scale;
+						next_for_pattern[i] = -1;
+					}
+					else
+					{
+						next_for_pattern[i] = solver->column_start[x + 1] + solver->slot_for_state[newstate];
+						remaining[i] = solver->memo_error[next_for_pattern[i]];
+					}
+				}
+
+				const int *errors = solver->row_error_table[x][fg][STATE_BG(state)][STATE_SEP(FLAGS, state)];
+				int i = context->get_lowest_total_error(errors, remaining);
+
+				if (errors[i] + remaining[i] < lowest_error)
+				{
+					lowest_error = errors[i] + remaining[i];
+					lowest_char = GFX_CHAR_FROM_INDEX(i);
+					lowest_next = next_for_pattern[i];
+				}
+			}
+
+			if ((FLAGS & SOLVER_DENSE))
+			{
+				lowest_error += next_base;
+				solver->char_for_xpos_in_state[DENSE_INDEX(FLAGS, x, state)] = lowest_char;
+			}
+
+			solver->memo_error[node] = lowest_error;
+			solver->memo_char[node] = lowest_char;
+			solver->memo_next[node] = lowest_next;
+		}
+
+		if ((FLAGS & SOLVER_DENSE))
+		{
+			// Now the lowest error in this column is known the rest can be stored relative to it
+
+			int base = INT_MAX;
+
+			for (int node = solver->column_start[x]; node < solver->column_start[x + 1]; node++)
+			{
+				base = MIN(base, solver->memo_error[node]);
+			}
+
+			solver->column_base[x] = base;
+			solver->column_saturated[x] = false;
+
+			for (int node = solver->column_start[x]; node < solver->column_start[x + 1]; node++)
+			{
+				int error = (solver->memo_error[node] - base + scale / 2) / scale;
+
+				if (error > DENSE_MAX_ERROR)
+				{
+					error = DENSE_MAX_ERROR;
+					solver->column_saturated[x] = true;
+				}
+
+				solver->total_error_in_state[DENSE_INDEX(FLAGS, x, solver->memo_state[node])] = error;
+			}
+
+			// Too big for 16 bits so the column to the left has to use the exact errors
+			if (solver->column_saturated[x])
+			{
+				for (int node = solver->column_start[x]; node < solver->column_start[x + 1]; node++)
+				{
+					solver->saturated_error[x & 1][solver->memo_state[node]] = solver->memo_error[node];
+				}
+
+				solver->saturated++;
+			}
+		}
+		else
+		{
+			reset_slots_for_column(solver, x + 1);
+		}
+	}
+
+	return solver->memo_error[0];
+}
+
+// Backtrack through the results of the last get_error_for_remainder_of_line() to fill in the chars for the line
+
+template<int FLAGS>
+void get_chars_for_remainder_of_line(row_solver *solver, int x7, int start_state, unsigned char *line)
+{
+	if ((FLAGS & SOLVER_DENSE))
+	{
+		int state = start_state;
+
+		for (int x = x7; x < MODE7_WIDTH; x++)
+		{
+			// Copy character chosen in this position for this state
+			line[x] = solver->char_for_xpos_in_state[DENSE_INDEX(FLAGS, x, state)];
+
+			// Update the state
+			state = get_state_for_char<FLAGS>(line[x], state);
+		}
+	}
+	else
+	{
+		int node = 0;
+
+		for (int x = x7; x < MODE7_WIDTH; x++)
+		{
+			line[x] = solver->memo_char[node];
+			node = solver->memo_next[node];
+		}
+	}
+}
+
+// Walk back from a node at the end of the line to fill in the chars that got there
+
+void get_chars_for_search_node(row_solver *solver, int node, unsigned char *line)
+{
+	for (; solver->search_parent[node] != -1; node = solver->search_parent[node])
+	{
+		line[solver->search_x[node] - 1] = solver->search_char[node];
+	}
+}
+
+// Best-first (A*) search for the lowest error line from column x7 onwards starting in the given state
+// The lower bound for the rest of the line is the sum of the lowest error any cell could have from here on - whatever
+// the colours or pattern - so it never overestimates and the first complete line taken off the open list is optimal.
+// Where most cells can be matched exactly the bound is tight and only states near the best line get expanded.
+// Fills in line and returns its error - solver->search_size is the number of nodes found.
+
+int add_search_node(row_solver *solver, int x, int state, int parent, unsigned char proposed_char, int g)
+{
+	if (solver->search_size == solver->search_capacity)
+	{
+		solver->search_capacity = solver->search_capacity ? solver->search_capacity * 2 : 65536;
+
+		solver->search_state = (unsigned short *)realloc(solver->search_state, solver->search_capacity * sizeof(unsigned short));
+		solver->search_x = (unsigned char *)realloc(solver->search_x, solver->search_capacity * sizeof(unsigned char));
+		solver->search_char = (unsigned char *)realloc(solver->search_char, solver->search_capacity * sizeof(unsigned char));
+		solver->search_parent = (int *)realloc(solver->search_parent, solver->search_capacity * sizeof(int));
+		solver->search_g = (int *)realloc(solver->search_g, solver->search_capacity * sizeof(int));
+		solver->heap = (best_first_entry *)realloc(solver->heap, solver->search_capacity * sizeof(best_first_entry));
+	}
+
+	int node = solver->search_size++;
+
+	solver->search_state[node] = state;
+	solver->search_x[node] = x;
+	solver->search_char[node] = proposed_char;
+	solver->search_parent[node] = parent;
+	solver->search_g[node] = g;
+
+	return node;
+}
+
+template<int FLAGS>
+void add_open_node(row_solver *solver, int x, int state, int parent, unsigned char proposed_char, int g)
+{
+	int *best_g = &solver->best_first_g[x * SOLVER_MAX_STATE(FLAGS) + state];
+
+	// Already reached this state at least as cheaply
+	if (g >= *best_g)
+		return;
+
+	*best_g = g;
+
+	int node = add_search_node(solver, x, state, parent, proposed_char, g);
+
+	best_first_entry entry = { g + solver->lower_bound[x], g, node };
+
+	solver->heap[solver->heap_size++] = entry;
+	std::push_heap(solver->heap, solver->heap + solver->heap_size);
+}
+
+template<int FLAGS>
+int get_line_best_first(row_solver *solver, int x7, int start_state, unsigned char *line, int *expanded)
+{
+	unsigned char candidates[MAX_CANDIDATES];
+
+	// Lowest possible error for each cell summed right to left
+
+	solver->lower_bound[MODE7_WIDTH] = 0;
+
+	for (int x = MODE7_WIDTH - 1; x >= x7; x--)
+	{
+		int lowest_error = INT_MAX;
+
+		for (int sep = 0; sep <= ((FLAGS & SOLVER_SEP) ? 1 : 0); sep++)
+		{
+			for (int fg = 1; fg < 8; fg++)
+			{
+				for (int bg = 0; bg < 8; bg++)
+				{
+					int error = solver->row_error_table[x][fg][bg][sep][GFX_INDEX_FROM_CHAR(solver->row_gfx_char_table[x][fg][bg][sep])];
+
+					if (error < lowest_error) lowest_error = error;
+				}
+			}
+		}
+
+		solver->lower_bound[x] = solver->lower_bound[x + 1] + lowest_error;
+	}
+
+	solver->search_size = 0;
+	solver->heap_size = 0;
+	*expanded = 0;
+
+	add_open_node<FLAGS>(solver, x7, start_state, -1, 0, 0);
+
+	int goal = -1;
+	int goal_error = 0;
+
+	while (solver->heap_size > 0)
+	{
+		std::pop_heap(solver->heap, solver->heap + solver->heap_size);
+		best_first_entry entry = solver->heap[--solver->heap_size];
+
+		int node = entry.node;
+		int x = solver->search_x[node];
+		int state = solver->search_state[node];
+
+		// Stale entry - this state has been reached more cheaply since
+		if (entry.g > solver->best_first_g[x * SOLVER_MAX_STATE(FLAGS) + state])
+			continue;
+
+		if (x == MODE7_WIDTH)
+		{
+			goal = node;
+			goal_error = entry.g;
+			break;
+		}
+
+		(*expanded)++;
+
+		int fg = STATE_FG(state);
+		unsigned char graphic_char = (FLAGS & SOLVER_TRY_ALL) ? MODE7_BLANK : get_graphic_char_from_image(solver, x, fg, STATE_BG(state), STATE_SEP(FLAGS, state));
+		int num_candidates = get_candidate_chars_for_state<FLAGS>(state, graphic_char, candidates);
+
+		for (int c = 0; c < num_candidates; c++)
+		{
+			int newstate = get_state_for_char<FLAGS>(candidates[c], state);
+			int error = get_error_for_char<FLAGS>(solver, x, candidates[c], fg, STATE_BG(newstate), STATE_HOLD(newstate), STATE_LAST_GFX_INDEX(newstate), STATE_SEP(FLAGS, newstate));
+
+			add_open_node<FLAGS>(solver, x + 1, newstate, node, candidates[c], entry.g + error);
+		}
+
+		if (FLAGS & SOLVER_TRY_ALL)
+		{
+			const int *errors = solver->row_error_table[x][fg][STATE_BG(state)][STATE_SEP(FLAGS, state)];
+			int newstate_for_blank = get_state_for_char<FLAGS>(MODE7_BLANK, state);
+
+			for (int i = 1; i < 64; i++)
+			{
+				add_open_node<FLAGS>(solver, x + 1, get_state_for_graphic_char<FLAGS>(newstate_for_blank, i), node, GFX_CHAR_FROM_INDEX(i), entry.g + errors[i]);
+			}
+		}
+	}
+
+	get_chars_for_search_node(solver, goal, line);
+
+	// Put best_first_g back how we found it for the next row
+
+	for (int node = 0; node < solver->search_size; node++)
+	{
+		solver->best_first_g[solver->search_x[node] * SOLVER_MAX_STATE(FLAGS) + solver->search_state[node]] = INT_MAX;
+	}
+
+	return goal_error;
+}
+
+// Add a node for this state in the next column of the beam search or update it if this is a lower error way to get there
+
+void add_beam_node(row_solver *solver, int column_start, int x, int state, int parent, unsigned char proposed_char, int g)
+{
+	if (solver->slot_for_state[state] == NO_SLOT)
+	{
+		solver->slot_for_state[state] = solver->search_size - column_start;
+		add_search_node(solver, x, state, parent, proposed_char, g);
+	}
+	else
+	{
+		int node = column_start + solver->slot_for_state[state];
+
+		if (g < solver->search_g[node])
+		{
+			solver->search_g[node] = g;
+			solver->search_parent[node] = parent;
+			solver->search_char[node] = proposed_char;
+		}
+	}
+}
+
+// Order beam nodes by error so far then by when they were found so the result doesn't depend on how they get sorted
+
+struct beam_node_less
+{
+	const row_solver *solver;
+
+	beam_node_less(const row_solver *s) : solver(s) {}
+
+	bool operator()(int a, int b) const
+	{
+		if (solver->search_g[a] != solver->search_g[b]) return solver->search_g[a] < solver->search_g[b];
+		return a < b;
+	}
+};
+
+// Beam search - like the forward sweep of get_error_for_remainder_of_line() but only the beam_width states with the
+// lowest error so far are kept in each column, so the cost of a row is fixed whatever the image looks like.
+// The line found isn't necessarily the best one. Fills in line and returns its error.
+
+template<int FLAGS>
+int get_line_beam(row_solver *solver, int x7, int start_state, unsigned char *line)
+{
+	image2mode7_context *context = solver->context;
+
+	unsigned char candidates[MAX_CANDIDATES];
+
+	solver->search_size = 0;
+
+	solver->beam[0] = add_search_node(solver, x7, start_state, -1, 0, 0);
+	int beam_size = 1;
+
+	for (int x = x7; x < MODE7_WIDTH; x++)
+	{
+		int column_start = solver->search_size;
+
+		// Every state reachable from the beam - keeping only the lowest error way to get to each one (first wins)
+
+		for (int b = 0; b < beam_size; b++)
+		{
+			int node = solver->beam[b];
+			int state = solver->search_state[node];
+			int g = solver->search_g[node];
+			int fg = STATE_FG(state);
+
+			unsigned char graphic_char = (FLAGS & SOLVER_TRY_ALL) ? MODE7_BLANK : get_graphic_char_from_image(solver, x, fg, STATE_BG(state), STATE_SEP(FLAGS, state));
+			int num_candidates = get_candidate_chars_for_state<FLAGS>(state, graphic_char, candidates);
+
+			for (int c = 0; c < num_candidates; c++)
+			{
+				int newstate = get_state_for_char<FLAGS>(candidates[c], state);
+				int error = get_error_for_char<FLAGS>(solver, x, candidates[c], fg, STATE_BG(newstate), STATE_HOLD(newstate), STATE_LAST_GFX_INDEX(newstate), STATE_SEP(FLAGS, newstate));
+
+				add_beam_node(solver, column_start, x + 1, newstate, node, candidates[c], g + error);
+			}
+
+			if (FLAGS & SOLVER_TRY_ALL)
+			{
+				const int *errors = solver->row_error_table[x][fg][STATE_BG(state)][STATE_SEP(FLAGS, state)];
+				int newstate_for_blank = get_state_for_char<FLAGS>(MODE7_BLANK, state);
+
+				for (int i = 1; i < 64; i++)
+				{
+					add_beam_node(solver, column_start, x + 1, get_state_for_graphic_char<FLAGS>(newstate_for_blank, i), node, GFX_CHAR_FROM_INDEX(i), g + errors[i]);
+				}
+			}
+		}
+
+		for (int node = column_start; node < solver->search_size; node++)
+		{
+			solver->slot_for_state[solver->search_state[node]] = NO_SLOT;
+		}
+
+		// Keep the lowest error states for the next column
+
+		beam_size = solver->search_size - column_start;
+
+		for (int b = 0; b < beam_size; b++)
+		{
+			solver->beam[b] = column_start + b;
+		}
+
+		if (beam_size > context->options.beam_width)
+		{
+			std::nth_element(solver->beam, solver->beam + context->options.beam_width, solver->beam + beam_size, beam_node_less(solver));
+			beam_size = context->options.beam_width;
+		}
+	}
+
+	// Best of whatever made it to the end of the line
+
+	int best = solver->beam[0];
+
+	for (int b = 1; b < beam_size; b++)
+	{
+		if (beam_node_less(solver)(solver->beam[b], best)) best = solver->beam[b];
+	}
+
+	get_chars_for_search_node(solver, best, line);
+
+	return solver->search_g[best];
+}
+
+// Error for a line that has already been chosen - the dense memo only keeps approximate errors once scaled
+
+template<int FLAGS>
+int get_error_for_line(row_solver *solver, int x7, int start_state, const unsigned char *line)
+{
+	int state = start_state;
+	int error = 0;
+
+	for (int x = x7; x < MODE7_WIDTH; x++)
+	{
+		int newstate = get_state_for_char<FLAGS>(line[x], state);
+
+		error += get_error_for_char<FLAGS>(solver, x, line[x], STATE_FG(state), STATE_BG(newstate), STATE_HOLD(newstate), STATE_LAST_GFX_INDEX(newstate), STATE_SEP(FLAGS, newstate));
+		state = newstate;
+	}
+
+	return error;
+}
+
+// Solve the line with the DP and fill in its chars
+
+template<int FLAGS>
+int solve_line_dp(row_solver *solver, int x7, int start_state, unsigned char *line)
+{
+	int error = get_error_for_remainder_of_line<FLAGS>(solver, x7, start_state);
+
+	get_chars_for_remainder_of_line<FLAGS>(solver, x7, start_state, line);
+
+	if ((FLAGS & SOLVER_DENSE) && solver->memo_scale > 1)
+	{
+		error = get_error_for_line<FLAGS>(solver, x7, start_state, line);
+	}
+
+	return error;
+}
+
+row_solver *create_row_solver(image2mode7_context *context)
+{
+	row_solver *solver = (row_solver *)calloc(1, sizeof(row_solver));
+
+	solver->context = context;
+
+	// Only need room for the states these options can reach
+	int num_states = SOLVER_MAX_STATE(context->solver_flags);
+
+	if (context->options.use_dense_memo)
+	{
+		solver->generation_for_state = (unsigned int *)calloc((MODE7_WIDTH + 1) * num_states, sizeof(unsigned int));
+		solver->total_error_in_state = (unsigned short *)malloc((MODE7_WIDTH + 1) * num_states * sizeof(unsigned short));
+		solver->char_for_xpos_in_state = (unsigned char *)malloc((MODE7_WIDTH + 1) * num_states * sizeof(unsigned char));
+		solver->saturated_error[0] = (int *)malloc(num_states * sizeof(int));
+		solver->saturated_error[1] = (int *)malloc(num_states * sizeof(int));
+	}
+
+	// Used by the sparse memo & the beam search
+	clear_slot_for_state(solver);
+
+	if (context->options.beam_width > 0)
+	{
+		solver->beam = (int *)malloc(num_states * sizeof(int));
+	}
+
+	if (context->options.use_best_first)
+	{
+		solver->best_first_g = (int *)malloc((MODE7_WIDTH + 1) * num_states * sizeof(int));
+
+		for (int i = 0; i < (MODE7_WIDTH + 1) * num_states; i++)
+		{
+			solver->best_first_g[i] = INT_MAX;
+		}
+	}
+
+	return solver;
+}
+
+void destroy_row_solver(row_solver *solver)
+{
+	free(solver->memo_state);
+	free(solver->memo_gfx_char);
+	free(solver->memo_char);
+	free(solver->memo_error);
+	free(solver->memo_next);
+
+	free(solver->generation_for_state);
+	free(solver->total_error_in_state);
+	free(solver->char_for_xpos_in_state);
+	free(solver->saturated_error[0]);
+	free(solver->saturated_error[1]);
+
+	free(solver->search_state);
+	free(solver->search_x);
+	free(solver->search_char);
+	free(solver->search_parent);
+	free(solver->search_g);
+	free(solver->heap);
+	free(solver->beam);
+	free(solver->best_first_g);
+
+	free(solver);
+}
+
+// Row cache - a hash table of solved rows with a least recently used list through it to pick which to drop
+
+unsigned long long hash_bytes(unsigned long long hash, const unsigned char *bytes, int size)
+{
+	// 64-bit FNV-1a - matching entries are compared in full so this only has to spread rows across the buckets
+
+	for (int i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+unsigned long long get_row_cache_seed(const image2mode7_context *context)
+{
+	// Everything besides the pixels that can change the line chosen for a row
+
+	int options[] = {
+		context->solver_flags,
+		context->options.sep_fg_factor,
+		context->options.memo_scale,
+		context->options.use_best_first,
+		context->options.beam_width
+	};
+
+	return hash_bytes(0xcbf29ce484222325ULL, (const unsigned char *)options, sizeof(options));
+}
+
+void create_row_cache(image2mode7_context *context, int size)
+{
+	context->row_cache_seed = get_row_cache_seed(context);
+	context->row_cache = NULL;
+	context->row_cache_buckets = NULL;
+	context->row_cache_size = 0;
+	context->row_cache_num_buckets = 0;
+	context->row_cache_head = NO_ENTRY;
+	context->row_cache_tail = NO_ENTRY;
+	context->row_cache_lookups = 0;
+	context->row_cache_hits = 0;
+
+	if (size <= 0)
+		return;
+
+	// At least twice as many buckets as entries, power of 2 so the hash can be masked
+
+	context->row_cache_num_buckets = 1;
+
+	while (context->row_cache_num_buckets < size * 2)
+	{
+		context->row_cache_num_buckets *= 2;
+	}
+
+	context->row_cache = (row_cache_entry *)malloc(size * sizeof(row_cache_entry));
+	context->row_cache_buckets = (int *)malloc(context->row_cache_num_buckets * sizeof(int));
+
+	for (int b = 0; b < context->row_cache_num_buckets; b++)
+	{
+		context->row_cache_buckets[b] = NO_ENTRY;
+	}
+}
+
+void destroy_row_cache(image2mode7_context *context)
+{
+	free(context->row_cache);
+	free(context->row_cache_buckets);
+}
+
+void get_row_cache_key(const image2mode7_context *context, int y7, unsigned char *key)
+{
+	// Every pixel that the error table for the row is built from - black outside the image
+
+	int y = IMAGE_Y_FROM_Y7(y7);
+
+	for (int py = y; py < y + 3; py++)
+	{
+		for (int px = 0; px < MODE7_PIXEL_W; px++)
+		{
+			bool inside = px < (int)IMAGE_W && py < (int)IMAGE_H;
+
+			*key++ = inside ? context->src(px, py, 0) : 0;
+			*key++ = inside ? context->src(px, py, 1) : 0;
+			*key++ = inside ? context->src(px, py, 2) : 0;
+		}
+	}
+}
+
+int find_row_cache_entry(const image2mode7_context *context, unsigned long long hash, const unsigned char *key)
+{
+	int entry = context->row_cache_buckets[hash & (context->row_cache_num_buckets - 1)];
+
+	while (entry != NO_ENTRY)
+	{
+		const row_cache_entry *e = &context->row_cache[entry];
+
+		if (e->hash == hash && memcmp(e->key, key, ROW_CACHE_KEY_SIZE) == 0)
+			return entry;
+
+		entry = e->bucket_next;
+	}
+
+	return NO_ENTRY;
+}
+
+void unlink_row_cache_entry(image2mode7_context *context, int entry)
+{
+	row_cache_entry *e = &context->row_cache[entry];
+
+	if (e->lru_prev != NO_ENTRY) context->row_cache[e->lru_prev].lru_next = e->lru_next;
+	else context->row_cache_head = e->lru_next;
+
+	if (e->lru_next != NO_ENTRY) context->row_cache[e->lru_next].lru_prev = e->lru_prev;
+	else context->row_cache_tail = e->lru_prev;
+}
+
+void link_row_cache_entry(image2mode7_context *context, int entry)
+{
+	// Most recently used goes at the head
+
+	row_cache_entry *e = &context->row_cache[entry];
+
+	e->lru_prev = NO_ENTRY;
+	e->lru_next = context->row_cache_head;
+
+	if (context->row_cache_head != NO_ENTRY) context->row_cache[context->row_cache_head].lru_prev = entry;
+	else context->row_cache_tail = entry;
+
+	context->row_cache_head = entry;
+}
+
+bool lookup_row_cache(image2mode7_context *context, unsigned long long hash, const unsigned char *key, unsigned char *line, row_result *result)
+{
+	std::lock_guard<std::mutex> lock(context->row_cache_mutex);
+
+	context->row_cache_lookups++;
+
+	int entry = find_row_cache_entry(context, hash, key);
+
+	if (entry == NO_ENTRY)
+		return false;
+
+	unlink_row_cache_entry(context, entry);
+	link_row_cache_entry(context, entry);
+
+	const row_cache_entry *e = &context->row_cache[entry];
+
+	memcpy(line, e->line, MODE7_WIDTH);
+
+	memset(result, 0, sizeof(row_result));
+	result->start_colour = e->start_colour;
+	result->error = e->error;
+	result->exact_error = e->exact_error;
+	result->cached = 1;
+
+	context->row_cache_hits++;
+
+	return true;
+}
+
+void insert_row_cache(image2mode7_context *context, unsigned long long hash, const unsigned char *key, const unsigned char *line, const row_result *result)
+{
+	std::lock_guard<std::mutex> lock(context->row_cache_mutex);
+
+	// Another thread may have solved the same row meanwhile
+
+	if (find_row_cache_entry(context, hash, key) != NO_ENTRY)
+		return;
+
+	int entry;
+
+	if (context->row_cache_size < context->options.row_cache_rows)
+	{
+		entry = context->row_cache_size++;
+	}
+	else
+	{
+		// Full so reuse the least recently used entry - take it out of its bucket first
+
+		entry = context->row_cache_tail;
+
+		unlink_row_cache_entry(context, entry);
+
+		int *link = &context->row_cache_buckets[context->row_cache[entry].hash & (context->row_cache_num_buckets - 1)];
+
+		while (*link != entry)
+		{
+			link = &context->row_cache[*link].bucket_next;
+		}
+
+		*link = context->row_cache[entry].bucket_next;
+	}
+
+	row_cache_entry *e = &context->row_cache[entry];
+
+	e->hash = hash;
+	memcpy(e->key, key, ROW_CACHE_KEY_SIZE);
+	memcpy(e->line, line, MODE7_WIDTH);
+	e->start_colour = result->start_colour;
+	e->error = result->error;
+	e->exact_error = result->exact_error;
+
+	int *bucket = &context->row_cache_buckets[hash & (context->row_cache_num_buckets - 1)];
+
+	e->bucket_next = *bucket;
+	*bucket = entry;
+
+	link_row_cache_entry(context, entry);
+}
+
+void copy_row_to_mode7(image2mode7_context *context, int y7, int start_colour, const unsigned char *line)
+{
+	// Set this state before frame begins
+	context->mode7[(y7 * MODE7_WIDTH) + (FRAME_FIRST_COLUMN - 1)] = MODE7_GFX_COLOUR + start_colour;
+
+	// Copy the resulting character data into MODE 7 screen
+
+	for (int x7 = FRAME_FIRST_COLUMN; x7 < (FRAME_FIRST_COLUMN + FRAME_WIDTH); x7++)
+	{
+		context->mode7[(y7 * MODE7_WIDTH) + (x7)] = line[x7];
+	}
+
+	// For when image is narrower than screen width
+
+	if (FRAME_FIRST_COLUMN + FRAME_WIDTH < MODE7_WIDTH)
+	{
+		context->mode7[(y7 * MODE7_WIDTH) + FRAME_FIRST_COLUMN + FRAME_WIDTH] = MODE7_BLACK_BG;
+	}
+}
+
+// Solve a whole character row into mode7
+
+template<int FLAGS>
+void solve_row(row_solver *solver, int y7, row_result *result)
+{
+	image2mode7_context *context = solver->context;
+
+	// Reset state as starting new character row
+	// State = fg colour + bg colour + hold character + prev character
+	// For each character cell on this line
+	// Do we have pixels or not?
+	// If we have pixels then need to decide whether is it better to replace this cell with a control code or keep pixels
+	// Possible control codes are: new fg colour, fill (bg colour = fg colour), no fill (bg colour = black), hold graphics (hold char = prev char), release graphics (hold char = empty)
+	// "Better" means that the "error" for the rest of the line (appearance on screen vs actual image = deviation) is minimised
+
+	// Beam search is checked against the exact DP in verbose mode
+	bool check_beam = context->options.beam_width > 0 && context->options.verbose;
+
+	// As is the dense memo against the sparse one - they should give the same line unless -memoscale is above 1
+	bool check_dense = (FLAGS & SOLVER_DENSE) && context->options.verbose;
+
+	// Nothing to do if we've solved a row with exactly the same pixels before
+
+	unsigned char line[MODE7_WIDTH];
+	unsigned long long row_hash = 0;
+
+	if (context->row_cache)
+	{
+		get_row_cache_key(context, y7, solver->row_cache_key);
+		row_hash = hash_bytes(context->row_cache_seed, solver->row_cache_key, ROW_CACHE_KEY_SIZE);
+
+		if (lookup_row_cache(context, row_hash, solver->row_cache_key, line, result))
+		{
+			copy_row_to_mode7(context, y7, result->start_colour, line);
+			return;
+		}
+	}
+
+	// Clear our array of error values for each state & x position
+	if (FLAGS & SOLVER_DENSE)
+	{
+		clear_error_char_arrays<FLAGS>(solver);
+
+		solver->memo_scale = context->options.memo_scale;
+	}
+
+	// Work out the error for every possible cell on this line up front
+	build_error_table_for_row<FLAGS>(solver, y7);
+
+	int min_error = INT_MAX;
+	int min_colour = 0;
+
+	// Determine best initial state for line
+	for (int fg = 7; fg > 0; fg--)
+	{
+		// What would our first character look like in this state?
+		unsigned char first_char = get_graphic_char_from_image(solver, FRAME_FIRST_COLUMN, fg, 0, false);
+
+		// What's the error for that character?
+		int error = get_error_for_char<FLAGS>(solver, FRAME_FIRST_COLUMN, first_char, fg, 0, false, GFX_INDEX_FROM_CHAR(MODE7_BLANK), false);
+
+		// Find the lowest error corresponding to our possible start states
+		if (error < min_error)
+		{
+			min_error = error;
+			min_colour = fg;
+		}
+	}
+
+	// This is our initial state of the line
+	int state = GET_STATE(FLAGS, min_colour, 0, false, GFX_INDEX_FROM_CHAR(MODE7_BLANK), false);
+
+	// Solve the line starting from that state
+	result->start_colour = min_colour;
+	result->expanded = 0;
+	result->exact_error = 0;
+	result->saturated = 0;
+	result->dense_checked = 0;
+	result->dense_differs = 0;
+	result->cached = 0;
+
+	if (context->options.beam_width > 0)
+	{
+		result->error = get_line_beam<FLAGS>(solver, FRAME_FIRST_COLUMN, state, line);
+		result->states = solver->search_size;
+
+		if (check_beam)
+		{
+			unsigned char exact_line[MODE7_WIDTH];
+
+			result->exact_error = solve_line_dp<FLAGS>(solver, FRAME_FIRST_COLUMN, state, exact_line);
+		}
+	}
+	else if (context->options.use_best_first)
+	{
+		result->error = get_line_best_first<FLAGS>(solver, FRAME_FIRST_COLUMN, state, line, &result->expanded);
+		result->states = solver->search_size;
+	}
+	else
+	{
+		result->error = solve_line_dp<FLAGS>(solver, FRAME_FIRST_COLUMN, state, line);
+		result->states = solver->memo_size;
+
+		if (FLAGS & SOLVER_DENSE)
+		{
+			result->saturated = solver->saturated;
+		}
+
+		if (check_dense)
+		{
+			unsigned char sparse_line[MODE7_WIDTH];
+
+			solve_line_dp<FLAGS & ~SOLVER_DENSE>(solver, FRAME_FIRST_COLUMN, state, sparse_line);
+
+			result->dense_checked = 1;
+			result->dense_differs = memcmp(&line[FRAME_FIRST_COLUMN], &sparse_line[FRAME_FIRST_COLUMN], MODE7_WIDTH - FRAME_FIRST_COLUMN) != 0;
+		}
+	}
+
+	if (context->row_cache)
+	{
+		insert_row_cache(context, row_hash, solver->row_cache_key, line, result);
+	}
+
+	copy_row_to_mode7(context, y7, min_colour, line);
+}
+
+// Table of every solve_row<FLAGS> variant indexed by FLAGS
+
+typedef void (*solve_row_function)(row_solver *solver, int y7, row_result *result);
+
+template<int FLAGS>
+struct solve_row_variants
+{
+	static void fill(solve_row_function *table)
+	{
+		table[FLAGS] = solve_row<FLAGS>;
+		solve_row_variants<FLAGS - 1>::fill(table);
+	}
+};
+
+template<>
+struct solve_row_variants<0>
+{
+	static void fill(solve_row_function *table)
+	{
+		table[0] = solve_row<0>;
+	}
+};
+
+int get_solver_flags(const image2mode7_options *options)
+{
+	int flags = 0;
+
+	if (options->use_fill) flags |= SOLVER_FILL;
+	if (options->use_sep) flags |= SOLVER_SEP;
+	if (options->use_hold) flags |= SOLVER_HOLD;
+	if (options->try_all) flags |= SOLVER_TRY_ALL;
+	if (options->use_dense_memo) flags |= SOLVER_DENSE;
+	if (options->use_geometric) flags |= SOLVER_GEOMETRIC;
+
+	return flags;
+}
+
+solve_row_function select_solve_row(int flags)
+{
+	static solve_row_function table[SOLVER_NUM_VARIANTS];
+
+	static std::once_flag table_filled;
+	std::call_once(table_filled, solve_row_variants<SOLVER_NUM_VARIANTS - 1>::fill, table);
+
+	return table[flags];
+}
+
+// Each thread has its own solver and takes the next unsolved row until there are none left
+// Rows only write to their own part of mode7 & results so the output doesn't depend on the number of threads
+
+static std::mutex progress_mutex;
+
+void solve_rows_thread(row_solver *solver, std::atomic<int> *next_row)
+{
+	image2mode7_context *context = solver->context;
+
+	for (int y7 = (*next_row)++; y7 < FRAME_HEIGHT; y7 = (*next_row)++)
+	{
+		if (context->options.show_progress)
+		{
+			std::lock_guard<std::mutex> lock(progress_mutex);
+			printf("\rProcessing line %d/%d...", y7, FRAME_HEIGHT);
+		}
+
+		context->solve_row(solver, y7, &context->results[y7]);
+	}
+}
+
+void solve_rows(image2mode7_context *context)
+{
+	std::atomic<int> next_row(0);
+
+	int num_threads = context->options.num_threads;
+
+	if (num_threads <= 0)
+	{
+		num_threads = std::thread::hardware_concurrency();
+	}
+
+	num_threads = CLAMP(num_threads, 1, MODE7_MAX_HEIGHT);
+
+	// Solvers are kept with the context so their scratch space can be reused for the next conversion
+
+	if (context->num_solvers < num_threads)
+	{
+		context->solvers = (row_solver **)realloc(context->solvers, num_threads * sizeof(row_solver *));
+
+		for (int t = context->num_solvers; t < num_threads; t++)
+		{
+			context->solvers[t] = create_row_solver(context);
+		}
+
+		context->num_solvers = num_threads;
+	}
+
+	if (num_threads == 1)
+	{
+		solve_rows_thread(context->solvers[0], &next_row);
+		return;
+	}
+
+	std::vector<std::thread> threads;
+
+	for (int t = 0; t < num_threads; t++)
+	{
+		threads.push_back(std::thread(solve_rows_thread, context->solvers[t], &next_row));
+	}
+
+	for (int t = 0; t < num_threads; t++)
+	{
+		threads[t].join();
+	}
+}
+
+int match_closest_palette_colour(unsigned char r, unsigned char g, unsigned char b)
+{
+	int min_error = INT_MAX;
+	int min_colour = -1;
+
+	for (int c = 0; c < 8; c++)
+	{
+		unsigned char cr = GET_RED_FROM_COLOUR(c);
+		unsigned char cg = GET_GREEN_FROM_COLOUR(c);
+		unsigned char cb = GET_BLUE_FROM_COLOUR(c);
+
+		int error = ((cr - r) * (cr - r)) + ((cg - g) * (cg - g)) + ((cb - b) * (cb - b));
+
+		if (error < min_error)
+		{
+			min_error = error;
+			min_colour = c;
+		}
+	}
+
+	return min_colour;
+}
+
+//
+// Pre-processing - get the image to MODE 7 pixel resolution and (optionally) palette
+//
+
+// Size in MODE 7 pixels that an image_width x image_height image is scaled to
+
+void get_pixel_size(const image2mode7_options *options, int image_width, int image_height, int *pixel_width_out, int *pixel_height_out)
+{
+	int pixel_width, pixel_height;
+
+	if (options->no_scale)
+	{
+		pixel_width = image_width;
+		pixel_height = image_height;
+	}
+	else
+	{
+		// Calculate frame size - adjust to width
+		pixel_width = (MODE7_WIDTH - FRAME_FIRST_COLUMN) * 2;
+		pixel_height = pixel_width * image_height / image_width;
+		if (pixel_height % 3) pixel_height += (3 - (pixel_height % 3));
+
+		// Adjust to height
+		if (pixel_height > MODE7_PIXEL_H)
+		{
+			pixel_height = MODE7_PIXEL_H;
+			pixel_width = pixel_height * image_width / image_height;
+
+			if (pixel_width % 1) pixel_width++;
+
+			// Need to handle reset of background if frame_width < MODE7_WIDTH
+		}
+	}
+
+	*pixel_width_out = pixel_width;
+	*pixel_height_out = pixel_height;
+}
+
+// MODE 7 palette colour for a pixel with value V & minimum m - grey ramp if unsaturated, black if too dark,
+// otherwise QUANT_CLOSEST for the closest colour
+
+int get_quant_decision(const image2mode7_options *options, int V, int m)
+{
+	int C = V - m;							// Chroma - black to white
+	int S = 0;								// Saturation
+
+	if (C != 0)
+	{
+		S = 255 * C / V;
+	}
+
+	// If saturation too low assume grey
+
+	if (S < options->sat)
+	{
+		// Grey
+		// Adjust colour palette for grey scale
+		// Map value to colour ramp - change RAMP!
+
+		int midpoint = (options->white - options->black) / 2;
+
+		if (V < options->black)
+			return 0;
+		else if (V < (options->black + midpoint))
+			return 4;			// blue
+		else if (V < options->white)
+			return 6;			// cyan
+		else
+			return 7;			// white		// could use yellow?
+	}
+
+	// Colour
+	// If Value is too low then assume black
+
+	if (V < options->value)
+	{
+		return 0;
+	}
+
+	// Not black = full colour
+
+	return QUANT_CLOSEST;
+}
+
+// The closest palette colour is decided separately for each channel at 128 - a multiple of the bin size - so it is the
+// same across a bin. A bin is the same colour throughout if the decision is for every value & min its pixels can have
+
+void build_quant_lut(image2mode7_context *context)
+{
+	const image2mode7_options *options = &context->options;
+
+	if (context->quant_valid && context->quant_sat == options->sat && context->quant_value == options->value && context->quant_black == options->black && context->quant_white == options->white)
+		return;
+
+	context->quant_valid = true;
+	context->quant_sat = options->sat;
+	context->quant_value = options->value;
+	context->quant_black = options->black;
+	context->quant_white = options->white;
+	context->quant_mixed = 0;
+
+	for (int V = 0; V < 256; V++)
+	{
+		for (int m = 0; m <= V; m++)
+		{
+			context->quant_decision[V][m] = get_quant_decision(options, V, m);
+		}
+	}
+
+	int bin_size = 1 << QUANT_LUT_SHIFT;
+
+	for (int r = 0; r < 256; r += bin_size)
+	{
+		for (int g = 0; g < 256; g += bin_size)
+		{
+			for (int b = 0; b < 256; b += bin_size)
+			{
+				int low_V = MAX_3(r, g, b);
+				int low_m = MIN_3(r, g, b);
+				int decision = context->quant_decision[low_V][low_m];
+				int colour = decision == QUANT_CLOSEST ? match_closest_palette_colour(r, g, b) : decision;
+
+				for (int V = low_V; V < low_V + bin_size && colour != QUANT_MIXED; V++)
+				{
+					for (int m = low_m; m < low_m + bin_size && m <= V; m++)
+					{
+						if (context->quant_decision[V][m] != decision)
+						{
+							colour = QUANT_MIXED;
+							break;
+						}
+					}
+				}
+
+				if (colour == QUANT_MIXED) context->quant_mixed++;
+
+				context->quant_lut[QUANT_LUT_INDEX(r, g, b)] = colour;
+			}
+		}
+	}
+
+	if (options->verbose)
+	{
+		printf("Built MODE 7 palette lookup (%d of %d bins decided per pixel)...\n", context->quant_mixed, QUANT_LUT_SIZE);
+	}
+}
+
+inline int get_quant_colour(const image2mode7_context *context, int r, int g, int b)
+{
+	int colour = context->quant_lut[QUANT_LUT_INDEX(r, g, b)];
+
+	if (colour == QUANT_MIXED)
+	{
+		colour = context->quant_decision[MAX_3(r, g, b)][MIN_3(r, g, b)];
+
+		if (colour == QUANT_CLOSEST) colour = match_closest_palette_colour(r, g, b);
+	}
+
+	return colour;
+}
+
+// Dither & palette conversion are done together as each pixel comes out of the resampler, straight into src
+
+struct preprocess_state
+{
+	bool dither;
+	int modx, mody;
+	int dither_offset[16];					// added to each channel at (x % modx) + (y % mody) * modx
+
+	unsigned char *plane[3];				// src R, G & B
+	int width;
+
+	CImg<unsigned char> small_image;		// test images - only kept if asked for
+	CImg<unsigned char> dither_image;
+};
+
+void begin_preprocess(image2mode7_context *context, preprocess_state *state)
+{
+	const image2mode7_options *options = &context->options;
+
+	state->dither = options->dither > 1 && options->dither <= 5;
+
+	if (state->dither)
+	{
+		int modx = options->dither, mody = options->dither;
+
+		if (options->dither == 5)
+		{
+			modx = 2;
+			mody = 3;
+		}
+
+		int divisor = 2 * ((modx * mody) + 1);
+		int subtract = divisor / 2;
+		int *table = NULL;
+
+		if (options->verbose)
+		{
+			printf("Ordered dither %dx%d (divisor=%d subtract=%d)...\n", modx, mody, divisor, subtract);
+		}
+
+		switch (options->dither)
+		{
+		case 2:
+			table = dither2;
+			break;
+
+		case 3:
+			table = dither3;
+			break;
+
+		case 4:
+			table = dither4;
+			break;
+
+		case 5:
+			table = dither23;
+			break;
+
+		default:
+			break;
+		}
+
+		state->modx = modx;
+		state->mody = mody;
+
+		for (int i = 0; i < modx * mody; i++)
+		{
+			state->dither_offset[i] = 254 * (table[i] - subtract) / divisor;
+		}
+	}
+
+	if (options->verbose)
+	{
+		if (options->use_quant)
+		{
+			printf("Converting to MODE 7 palette...\n");
+		}
+		else
+		{
+			printf("Skipping conversion to MODE 7 palette...\n");
+		}
+	}
+
+	if (options->use_quant)
+	{
+		build_quant_lut(context);
+	}
+
+	state->plane[0] = context->src.data(0, 0, 0, 0);
+	state->plane[1] = context->src.data(0, 0, 0, 1);
+	state->plane[2] = context->src.data(0, 0, 0, 2);
+	state->width = IMAGE_W;
+
+	if (options->test_image_name)
+	{
+		if (!options->no_scale) state->small_image.assign(IMAGE_W, IMAGE_H, 1, 3);
+		if (state->dither) state->dither_image.assign(IMAGE_W, IMAGE_H, 1, 3);
+	}
+}
+
+inline void preprocess_pixel(image2mode7_context *context, preprocess_state *state, int x, int y, int r, int g, int b)
+{
+	if (!state->small_image.is_empty())
+	{
+		state->small_image(x, y, 0) = r;
+		state->small_image(x, y, 1) = g;
+		state->small_image(x, y, 2) = b;
+	}
+
+	if (state->dither)
+	{
+		int offset = state->dither_offset[(x % state->modx) + (y % state->mody) * state->modx];
+
+		r = MAX(MIN(r + offset, 255), 0);
+		g = MAX(MIN(g + offset, 255), 0);
+		b = MAX(MIN(b + offset, 255), 0);
+
+		if (!state->dither_image.is_empty())
+		{
+			state->dither_image(x, y, 0) = r;
+			state->dither_image(x, y, 1) = g;
+			state->dither_image(x, y, 2) = b;
+		}
+	}
+
+	if (context->options.use_quant)
+	{
+		int c = get_quant_colour(context, r, g, b);
+
+		r = GET_RED_FROM_COLOUR(c);
+		g = GET_GREEN_FROM_COLOUR(c);
+		b = GET_BLUE_FROM_COLOUR(c);
+	}
+
+	int i = y * state->width + x;
+
+	state->plane[0][i] = r;
+	state->plane[1][i] = g;
+	state->plane[2][i] = b;
+}
+
+void save_test_image(image2mode7_context *context, const CImg<unsigned char> &image, const char *suffix)
+{
+	const image2mode7_options *options = &context->options;
+	char filename[256];
+
+	if (options->verbose)
+	{
+		printf("Saving test image '%s_%s.png'...\n", options->test_image_name, suffix);
+	}
+
+	sprintf(filename, "%s_%s.png", options->test_image_name, suffix);
+	image.save(filename);
+}
+
+void end_preprocess(image2mode7_context *context, preprocess_state *state)
+{
+	// Save test images for debug
+
+	if (context->options.test_image_name)
+	{
+		if (!state->small_image.is_empty()) save_test_image(context, state->small_image, "small");
+		if (!state->dither_image.is_empty()) save_test_image(context, state->dither_image, "dither");
+		if (context->options.use_quant) save_test_image(context, context->src, "quant");
+	}
+}
+
+//
+// Area average resampling - every source pixel adds its overlap with each grid pixel it touches
+// Rows are added one at a time so memory doesn't depend on the image size & the result is exact so the same on any build
+// The squared error over a grid pixel's whole source area against colour c is n * (c - average)^2 plus a term that
+// doesn't depend on c, so measuring against the average already picks the same colours as the full resolution error
+//
+
+void set_resample_geometry(image2mode7_context *context, int width, int pixel_width)
+{
+	if (context->resample_width == width && context->resample_pixel_width == pixel_width)
+		return;
+
+	context->resample_width = width;
+	context->resample_pixel_width = pixel_width;
+
+	// Source pixel x covers [x * pixel_width, (x + 1) * pixel_width) & grid pixel px covers [px * width, (px + 1) * width)
+
+	int total = 0;
+
+	for (int px = 0; px < pixel_width; px++)
+	{
+		long long left = (long long)px * width;
+		long long right = left + width;
+
+		int first_x = (int)(left / pixel_width);
+		int end_x = (int)((right + pixel_width - 1) / pixel_width);
+
+		context->resample_first[px] = first_x * 3;
+		context->resample_count[px] = (end_x - first_x) * 3;
+		context->resample_offset[px] = total;
+
+		total += context->resample_count[px];
+	}
+
+	context->resample_weights = (unsigned short *)realloc(context->resample_weights, total * sizeof(unsigned short));
+
+	for (int px = 0; px < pixel_width; px++)
+	{
+		long long left = (long long)px * width;
+		long long right = left + width;
+
+		unsigned short *weights = &context->resample_weights[context->resample_offset[px]];
+
+		for (int x = context->resample_first[px] / 3; x * 3 < context->resample_first[px] + context->resample_count[px]; x++)
+		{
+			long long overlap = MIN(right, (long long)(x + 1) * pixel_width) - MAX(left, (long long)x * pixel_width);
+
+			*weights++ = (unsigned short)overlap;
+			*weights++ = (unsigned short)overlap;
+			*weights++ = (unsigned short)overlap;
+		}
+	}
+}
+
+void begin_stream(image2mode7_context *context, int width, int height)
+{
+	context->stream_active = true;
+	context->stream_width = width;
+	context->stream_height = height;
+	context->stream_row = 0;
+
+	get_pixel_size(&context->options, width, height, &context->stream_pixel_width, &context->stream_pixel_height);
+
+	if (context->options.no_scale)
+	{
+		// Nothing to average so rows go straight into the image (black if any are missing)
+		context->src.assign(width, height, 1, 3, 0);
+	}
+	else
+	{
+		set_resample_geometry(context, width, context->stream_pixel_width);
+
+		memset(context->stream_sums, 0, sizeof(context->stream_sums));
+	}
+}
+
+void add_stream_row(image2mode7_context *context, const unsigned char *rgb)
+{
+	int width = context->stream_width;
+	int height = context->stream_height;
+	int pixel_width = context->stream_pixel_width;
+	int pixel_height = context->stream_pixel_height;
+	int y = context->stream_row++;
+
+	if (context->options.no_scale)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			context->src(x, y, 0) = rgb[x * 3 + 0];
+			context->src(x, y, 1) = rgb[x * 3 + 1];
+			context->src(x, y, 2) = rgb[x * 3 + 2];
+		}
+
+		return;
+	}
+
+	// Across
+
+	for (int px = 0; px < pixel_width; px++)
+	{
+		unsigned int sums[3];
+
+		context->sum_weighted_pixels(&rgb[context->resample_first[px]], &context->resample_weights[context->resample_offset[px]], context->resample_count[px], sums);
+
+		context->stream_row_sums[px][0] = sums[0];
+		context->stream_row_sums[px][1] = sums[1];
+		context->stream_row_sums[px][2] = sums[2];
+	}
+
+	// Down - the same for this row against each grid row it touches
+
+	long long top = (long long)y * pixel_height;
+	long long bottom = top + pixel_height;
+
+	for (int py = (int)(top / height); py < pixel_height && (long long)py * height < bottom; py++)
+	{
+		long long overlap = MIN(bottom, (long long)(py + 1) * height) - MAX(top, (long long)py * height);
+
+		for (int px = 0; px < pixel_width; px++)
+		{
+			context->stream_sums[py][px][0] += context->stream_row_sums[px][0] * overlap;
+			context->stream_sums[py][px][1] += context->stream_row_sums[px][1] * overlap;
+			context->stream_sums[py][px][2] += context->stream_row_sums[px][2] * overlap;
+		}
+	}
+}
+
+void end_stream(image2mode7_context *context)
+{
+	const image2mode7_options *options = &context->options;
+	preprocess_state state;
+
+	context->stream_active = false;
+
+	if (options->no_scale)
+	{
+		if (options->verbose)
+		{
+			printf("Leaving size as %d x %d pixels...\n", IMAGE_W, IMAGE_H);
+		}
+
+		// Already in src so just dither & convert in place
+
+		begin_preprocess(context, &state);
+
+		for (int y = 0; y < (int)IMAGE_H; y++)
+		{
+			for (int x = 0; x < (int)IMAGE_W; x++)
+			{
+				preprocess_pixel(context, &state, x, y, context->src(x, y, 0), context->src(x, y, 1), context->src(x, y, 2));
+			}
+		}
+
+		end_preprocess(context, &state);
+		return;
+	}
+
+	int pixel_width = context->stream_pixel_width;
+	int pixel_height = context->stream_pixel_height;
+
+	if (options->verbose)
+	{
+		printf("Area averaged from %d x %d to %d x %d pixels...\n", context->stream_width, context->stream_height, pixel_width, pixel_height);
+	}
+
+	// Every grid pixel has total weight width x height
+
+	unsigned long long area = (unsigned long long)context->stream_width * context->stream_height;
+
+	context->src.assign(pixel_width, pixel_height, 1, 3);
+
+	begin_preprocess(context, &state);
+
+	for (int py = 0; py < pixel_height; py++)
+	{
+		for (int px = 0; px < pixel_width; px++)
+		{
+			const unsigned long long *sums = context->stream_sums[py][px];
+
+			preprocess_pixel(context, &state, px, py, (int)((sums[0] + area / 2) / area), (int)((sums[1] + area / 2) / area), (int)((sums[2] + area / 2) / area));
+		}
+	}
+
+	end_preprocess(context, &state);
+}
+
+// Convert the image in src - shared by whole image & streaming conversions
+
+int convert_src_image(image2mode7_context *context, unsigned char *page, int *frame_error)
+{
+	const image2mode7_options *options = &context->options;
+
+	// Already scaled down, dithered & converted to the palette by end_stream
+
+	int pixel_width = IMAGE_W;
+	int pixel_height = IMAGE_H;
+
+	//
+	// Conversion to MODE 7
+	//
+
+	context->frame_width = MIN(pixel_width / 2, MODE7_WIDTH - FRAME_FIRST_COLUMN);
+	context->frame_height = MIN(pixel_height / 3, MODE7_MAX_HEIGHT);
+
+	if (options->verbose)
+	{
+		printf("Converting to MODE 7 screen size %d x %d...\n", FRAME_WIDTH, FRAME_HEIGHT);
+		printf("Using %s pattern error kernels...\n", context->kernel_name);
+	}
+
+	// Set everything to blank
+	memset(context->mode7, MODE7_BLANK, FRAME_SIZE);
+
+	if (options->use_geometric)
+	{
+		build_palette_error_tables<true>(context);
+		build_display_error_cache<true>(context);
+	}
+	else
+	{
+		build_palette_error_tables<false>(context);
+		build_palette_index_plane(context);
+	}
+
+	// Solve every row - each one starts from a fresh state so they can be done in any order
+	solve_rows(context);
+
+	context->frame_error = 0;
+	context->frame_states = 0;
+	context->frame_expanded = 0;
+	context->frame_exact_error = 0;
+	context->frame_saturated = 0;
+	context->frame_dense_checked = 0;
+	context->frame_dense_differs = 0;
+	context->frame_cached = 0;
+
+	for (int y7 = 0; y7 < FRAME_HEIGHT; y7++)
+	{
+		if (options->verbose)
+		{
+			if (context->results[y7].cached)
+			{
+				printf("[%d] Start colour=%d Line error=%d Cached\n", y7, context->results[y7].start_colour, context->results[y7].error);
+			}
+			else if (options->beam_width > 0)
+			{
+				printf("[%d] Start colour=%d Line error=%d States=%d Exact error=%d\n", y7, context->results[y7].start_colour, context->results[y7].error, context->results[y7].states, context->results[y7].exact_error);
+			}
+			else if (options->use_best_first)
+			{
+				printf("[%d] Start colour=%d Line error=%d States=%d Expanded=%d\n", y7, context->results[y7].start_colour, context->results[y7].error, context->results[y7].states, context->results[y7].expanded);
+			}
+			else
+			{
+				printf("[%d] Start colour=%d Line error=%d States=%d\n", y7, context->results[y7].start_colour, context->results[y7].error, context->results[y7].states);
+			}
+		}
+
+		context->frame_error += context->results[y7].error;
+		context->frame_states += context->results[y7].states;
+		context->frame_expanded += context->results[y7].expanded;
+		context->frame_exact_error += context->results[y7].exact_error;
+		context->frame_saturated += context->results[y7].saturated;
+		context->frame_dense_checked += context->results[y7].dense_checked;
+		context->frame_dense_differs += context->results[y7].dense_differs;
+		context->frame_cached += context->results[y7].cached;
+	}
+
+	if (options->verbose)
+	{
+		printf("Total frame error = %d\n", context->frame_error);
+		printf("Total states touched = %d (of %d in dense tables)\n", context->frame_states, FRAME_HEIGHT * SOLVER_MAX_STATE(context->solver_flags) * (MODE7_WIDTH + 1));
+
+		if (options->use_dense_memo)
+		{
+			printf("Dense memo columns saturated = %d (scale %d) - read as exact errors instead\n", context->frame_saturated, options->memo_scale);
+			printf("Dense memo rows differing from sparse memo = %d (of %d rows checked)\n", context->frame_dense_differs, context->frame_dense_checked);
+		}
+
+		if (options->beam_width > 0)
+		{
+			int gap = context->frame_error - context->frame_exact_error;
+
+			printf("Beam search (width %d) gap to exact = %d (%.3f%%)\n", options->beam_width, gap, context->frame_exact_error ? 100.0 * gap / context->frame_exact_error : 0.0);
+		}
+		else if (options->use_best_first)
+		{
+			printf("Total nodes expanded = %d\n", context->frame_expanded);
+		}
+
+		if (context->row_cache)
+		{
+			printf("Row cache hits = %d of %d rows (%d of %d since created, %d rows cached)\n", context->frame_cached, FRAME_HEIGHT, context->row_cache_hits, context->row_cache_lookups, context->row_cache_size);
+		}
+		printf("MODE 7 frame size = %d bytes\n", FRAME_SIZE);
+	}
+	else if (options->show_progress)
+	{
+		printf("\n");
+	}
+
+	if (frame_error)
+	{
+		*frame_error = context->frame_error;
+	}
+
+	if (page)
+	{
+		memcpy(page, context->mode7, FRAME_SIZE);
+	}
+
+	return FRAME_SIZE;
+}
+
+//
+// Library interface
+//
+
+void image2mode7_default_options(image2mode7_options *options)
+{
+	memset(options, 0, sizeof(image2mode7_options));
+
+	options->sat = 64;
+	options->value = 64;
+	options->black = 64;
+	options->white = 128;
+
+	options->use_hold = 1;
+	options->use_fill = 1;
+	options->use_geometric = 1;
+	options->sep_fg_factor = 128;
+	options->use_simd = 1;
+	options->num_threads = 1;
+	options->row_cache_rows = 1024;
+}
+
+image2mode7_context *image2mode7_create(const image2mode7_options *options)
+{
+	image2mode7_context *context = new image2mode7_context();
+
+	if (options)
+	{
+		context->options = *options;
+	}
+	else
+	{
+		image2mode7_default_options(&context->options);
+	}
+
+	context->options.memo_scale = MAX(context->options.memo_scale, 1);
+
+	select_pattern_error_kernels(context, context->options.use_simd != 0);
+
+	context->solver_flags = get_solver_flags(&context->options);
+	context->solve_row = select_solve_row(context->solver_flags);
+
+	create_row_cache(context, context->options.row_cache_rows);
+
+	return context;
+}
+
+void image2mode7_destroy(image2mode7_context *context)
+{
+	if (!context)
+		return;
+
+	for (int t = 0; t < context->num_solvers; t++)
+	{
+		destroy_row_solver(context->solvers[t]);
+	}
+
+	free(context->solvers);
+
+	destroy_row_cache(context);
+
+	free(context->resample_weights);
+	free(context->display_error);
+
+	delete context;
+}
+
+int image2mode7_convert(image2mode7_context *context, const unsigned char *rgb, int width, int height, unsigned char *page, int *frame_error)
+{
+	if (!rgb || width <= 0 || height <= 0)
+		return -1;
+
+	// Area average straight from the caller's pixels - no full size copy
+
+	begin_stream(context, width, height);
+
+	for (int y = 0; y < height; y++)
+	{
+		add_stream_row(context, &rgb[(size_t)y * width * 3]);
+	}
+
+	end_stream(context);
+
+	return convert_src_image(context, page, frame_error);
+}
+
+int image2mode7_begin(image2mode7_context *context, int width, int height)
+{
+	if (width <= 0 || height <= 0)
+		return -1;
+
+	begin_stream(context, width, height);
+
+	return 0;
+}
+
+int image2mode7_add_rows(image2mode7_context *context, const unsigned char *rgb, int num_rows)
+{
+	if (!context->stream_active || !rgb)
+		return -1;
+
+	// Anything past the bottom of the image is ignored
+
+	num_rows = MIN(num_rows, context->stream_height - context->stream_row);
+
+	for (int row = 0; row < num_rows; row++)
+	{
+		add_stream_row(context, &rgb[(size_t)row * context->stream_width * 3]);
+	}
+
+	return 0;
+}
+
+int image2mode7_finish(image2mode7_context *context, unsigned char *page, int *frame_error)
+{
+	if (!context->stream_active)
+		return -1;
+
+	end_stream(context);
+
+	return convert_src_image(context, page, frame_error);
+}
+
+int image2mode7_convert_image(const unsigned char *rgb, int width, int height, const image2mode7_options *options, unsigned char *page, int *frame_error)
+{
+	image2mode7_context *context = image2mode7_create(options);
+
+	int size = image2mode7_convert(context, rgb, width, height, page, frame_error);
+
+	image2mode7_destroy(context);
+
+	return size;
+}
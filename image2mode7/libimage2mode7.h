@@ -0,0 +1,92 @@
+// libimage2mode7.h : Image -> MODE 7 (aka Teletext) conversion library
+//
+// Everything for a conversion lives in a context so any number of them can be used at once, from any threads.
+// A context keeps its scratch space between conversions so reuse one per thread when converting lots of images.
+//
+//   image2mode7_options options;
+//   image2mode7_default_options(&options);
+//   options.use_sep = 1;
+//
+//   image2mode7_context *context = image2mode7_create(&options);
+//   int size = image2mode7_convert(context, rgb, width, height, page, &frame_error);
+//   image2mode7_destroy(context);
+//
+// Or to keep memory use down for big images, feed rows in as they are decoded:
+//
+//   image2mode7_begin(context, width, height);
+//   image2mode7_add_rows(context, row, 1);		// for each row
+//   int size = image2mode7_finish(context, page, &frame_error);
+//
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define IMAGE2MODE7_PAGE_SIZE		1000				// 40 x 25 characters
+#define IMAGE2MODE7_MAX_PAGE_SIZE	(IMAGE2MODE7_PAGE_SIZE * 8)	// taller frames are possible with no_scale
+
+#define IMAGE2MODE7_PIXEL_WIDTH		78					// images are scaled to fit 39 x 25 cells of 2 x 3 sub-pixels
+#define IMAGE2MODE7_PIXEL_HEIGHT	75
+
+typedef struct image2mode7_options
+{
+	// Pre-processing
+	int no_scale;				// don't scale the image to MODE 7 resolution
+	int dither;					// ordered dithering (2=2x2 3=3x3 4=4x4 5=2x3 matrix)
+	int use_quant;				// quantise to 3-bit MODE 7 palette using HSV params below
+	int sat;					// saturation threshold (below this colour is considered grey)
+	int value;					// value threshold (below this colour is considered black)
+	int black;					// grey below this considered pure black
+	int white;					// grey above this considered pure white
+
+	// Solver
+	int use_hold;				// allow Hold Graphics control code
+	int use_fill;				// allow New Background control code
+	int use_sep;				// allow Separated Graphics control code
+	int sep_fg_factor;			// contribution of foreground vs background colour for separated graphics
+	int use_geometric;			// geometric distance for colour error (otherwise lookup table)
+	int try_all;				// calculate full line error for every possible graphics character
+	int use_dense_memo;			// dense error tables for every possible state rather than just those reached
+	int memo_scale;				// dense tables hold errors / memo_scale in 16 bits - exact at 1, columns that saturate use exact errors
+	int use_best_first;			// best-first (A*) search for each row - same error, far fewer states where cells match well
+	int beam_width;				// keep only this many states per column - fixed time per row but not always the best line (0 = exact)
+	int use_simd;				// use SSE4.1/AVX2 kernels if the CPU has them
+	int num_threads;			// number of threads to solve rows with (0 = one per CPU core)
+	int row_cache_rows;			// keep this many solved rows to reuse for identical rows in this or later images (0 = off)
+
+	// Diagnostics
+	int verbose;				// print details of each step to stdout
+	int show_progress;			// print line number as each row is solved
+	const char *test_image_name;	// if set save test images '<name>_small.png' etc. before Teletext conversion
+} image2mode7_options;
+
+typedef struct image2mode7_context image2mode7_context;
+
+// Fill in options with the same defaults as the command line tool
+void image2mode7_default_options(image2mode7_options *options);
+
+// NULL options means the defaults
+image2mode7_context *image2mode7_create(const image2mode7_options *options);
+void image2mode7_destroy(image2mode7_context *context);
+
+// Convert width x height 8-bit interleaved RGB pixels into MODE 7 characters
+// page must have room for IMAGE2MODE7_MAX_PAGE_SIZE bytes (IMAGE2MODE7_PAGE_SIZE without no_scale)
+// Returns the number of bytes written to page (40 per character row) or -1 if the image is no good
+int image2mode7_convert(image2mode7_context *context, const unsigned char *rgb, int width, int height, unsigned char *page, int *frame_error);
+
+// Streaming conversion for images too big to hold in memory - rows are area averaged down to size as they arrive
+// Begin with the image size then add the rows top to bottom (any number at a time) & finish to get the page as above
+// Missing rows are black & extra rows are ignored. All return -1 if the image is no good or nothing has begun
+int image2mode7_begin(image2mode7_context *context, int width, int height);
+int image2mode7_add_rows(image2mode7_context *context, const unsigned char *rgb, int num_rows);
+int image2mode7_finish(image2mode7_context *context, unsigned char *page, int *frame_error);
+
+// One-off conversion with a temporary context
+int image2mode7_convert_image(const unsigned char *rgb, int width, int height, const image2mode7_options *options, unsigned char *page, int *frame_error);
+
+#ifdef __cplusplus
+}
+#endif